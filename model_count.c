@@ -1,37 +1,227 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #define KEY_MODEL "model"
 #define INITIAL_BUCKETS 4096
 #define LOAD_FACTOR_NUM 3
 #define LOAD_FACTOR_DEN 4
 #define PROGRESS_INTERVAL_SEC 5.0
+#define READ_BUF_SIZE (1u << 20)
+
+/*
+ * Two table engines share the HashTable interface below: the original
+ * chained table, and an open-addressing "Swiss" table where each slot has
+ * one control byte (empty, or 7 bits of its hash) and lookups compare a whole
+ * group of 16 control bytes at once before touching any slot.  Slots keep
+ * the full hash and key length so most mismatches never read key bytes.
+ */
+enum { TABLE_CHAINED, TABLE_SWISS };
+
+#define SWISS_GROUP 16
+#define CTRL_EMPTY 0x80
+#define SWISS_LOAD_NUM 7
+#define SWISS_LOAD_DEN 8
+#define INLINE_KEY_MAX 23
+
+static int g_table_engine = TABLE_SWISS;
+
+/* Key bytes, NUL terminated.  Keys of up to INLINE_KEY_MAX bytes are stored
+ * in the entry or slot itself, so reaching the entry also reaches the key;
+ * only longer keys get a separate heap copy. */
+typedef union {
+    char inl[INLINE_KEY_MAX + 1];
+    char *ptr;
+} KeyStore;
 
 typedef struct Entry {
-    char *key;
-    uint64_t count;
     struct Entry *next;
+    uint64_t hash;
+    uint64_t count;
+    size_t len;
+    KeyStore key;
 } Entry;
 
 typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    size_t len;
+    KeyStore key;
+} Slot;
+
+typedef struct {
+    size_t reserved;  /* bytes obtained from the system */
+    size_t used;      /* bytes handed out */
+} ArenaStats;
+
+/*
+ * Bump allocator for entries and key bytes.  Allocations are never freed
+ * individually; the whole arena is released chunk by chunk when its table
+ * goes away.  Chunks can be backed by huge pages.
+ */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;  /* including this header */
+    int mapped;   /* from mmap() rather than malloc() */
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;
+    unsigned char *cur;
+    unsigned char *end;
+    size_t chunk_size;
+    int huge_pages;
+    ArenaStats stats;
+} Arena;
+
+/*
+ * Front cache: a small direct-mapped cache of recently counted values,
+ * checked before hashing.  Slots are indexed by the length and first eight
+ * bytes, so a hit on a short value costs a load, two compares and an
+ * increment.  Each window of lookups is scored; when the hit rate drops
+ * below half (high-cardinality fields) the cache is bypassed for a while
+ * and then tried again.
+ */
+#define FRONT_SLOTS 64
+#define FRONT_WINDOW 4096
+#define FRONT_BACKOFF (1u << 20)
+
+typedef struct {
+    size_t len;
+    uint64_t prefix;   /* first min(len, 8) bytes, zero padded */
+    const char *key;   /* stored key bytes, compared past the prefix */
+    uint64_t *count;   /* NULL when the slot is empty */
+} FrontSlot;
+
+typedef struct {
+    FrontSlot slots[FRONT_SLOTS];
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t bypass;   /* lookups left to skip */
+} FrontCache;
+
+static int g_front_cache = 1;
+
+struct Approx;
+struct Distinct;
+struct Series;
+
+typedef struct {
+    int engine;
+    size_t size;
+    Arena arena;
+    FrontCache front;
+    struct Approx *approx;  /* --approx sketch; replaces the entries */
+    struct Distinct *distinct;  /* --distinct sketches of the entries */
+    struct Series *series;      /* --bucket-by counts of the entries */
+
+    /* TABLE_CHAINED */
     Entry **buckets;
     size_t bucket_count;
-    size_t size;
+
+    /* TABLE_SWISS: capacity is a power-of-two number of groups */
+    uint8_t *ctrl;
+    Slot *slots;
+    size_t capacity;
+    size_t growth_left;
 } HashTable;
 
-static uint64_t hash_str(const char *s) {
-    uint64_t h = 1469598103934665603ULL;
-    while (*s) {
-        h ^= (unsigned char)*s++;
-        h *= 1099511628211ULL;
+/*
+ * Key hash: a seeded multiply-mix hash in the wyhash family that consumes
+ * 16 bytes per round and covers short tails with two overlapping loads.
+ * Keys are hashed once, when the scanner has located their bytes; tables
+ * store the full hash, so growing and merging never read key bytes again.
+ * All tables in a process share the seed, which is what lets a merge reuse
+ * stored hashes.
+ */
+static uint64_t g_hash_seed = 0x2d358dccaa6c78a5ULL;
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_bytes(const void *data, size_t len) {
+    const uint64_t k0 = 0xa0761d6478bd642fULL;
+    const uint64_t k1 = 0xe7037ed1a0b428dbULL;
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = g_hash_seed ^ k0;
+    size_t n = len;
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    for (; n > 16; n -= 16, p += 16) {
+        h = hash_mix(load64(p) ^ k1, load64(p + 8) ^ h);
+    }
+    if (n >= 8) {
+        a = load64(p);
+        b = load64(p + n - 8);
+    } else if (n >= 4) {
+        a = load32(p);
+        b = load32(p + n - 4);
+    } else if (n > 0) {
+        a = (uint64_t)p[0] << 16 | (uint64_t)p[n >> 1] << 8 | p[n - 1];
     }
-    return h;
+    return hash_mix(k1 ^ (uint64_t)len, hash_mix(a ^ k1, b ^ h));
 }
 
 static void die(const char *msg) {
@@ -47,36 +237,116 @@ static void *xmalloc(size_t n) {
     return p;
 }
 
-static char *xstrdup(const char *s) {
-    size_t n = strlen(s) + 1;
-    char *d = (char *)xmalloc(n);
-    memcpy(d, s, n);
-    return d;
+#define ARENA_CHUNK_DEFAULT ((size_t)1 << 20)
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t g_arena_chunk_size = ARENA_CHUNK_DEFAULT;
+static int g_arena_huge_pages = 0;
+
+static void arena_init(Arena *a) {
+    memset(a, 0, sizeof(*a));
+    a->chunk_size = g_arena_chunk_size;
+    a->huge_pages = g_arena_huge_pages;
 }
 
-static void table_init(HashTable *t, size_t buckets) {
+static void arena_new_chunk(Arena *a, size_t need) {
+    size_t size = a->chunk_size;
+    if (size < need + sizeof(ArenaChunk)) size = need + sizeof(ArenaChunk);
+
+    ArenaChunk *c;
+    int mapped = 0;
+    if (a->huge_pages) {
+        /* Explicit huge pages when the system has them reserved, otherwise
+         * ask for transparent huge pages on an aligned mapping. */
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *m = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+        if (m == MAP_FAILED) {
+            m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m == MAP_FAILED) die("Out of memory");
+#ifdef MADV_HUGEPAGE
+            madvise(m, size, MADV_HUGEPAGE);
+#endif
+        }
+        c = (ArenaChunk *)m;
+        mapped = 1;
+    } else {
+        c = (ArenaChunk *)xmalloc(size);
+    }
+
+    c->next = a->chunks;
+    c->size = size;
+    c->mapped = mapped;
+    a->chunks = c;
+    a->cur = (unsigned char *)(c + 1);
+    a->end = (unsigned char *)c + size;
+    a->stats.reserved += size;
+}
+
+/* align must be a power of two. */
+static void *arena_alloc(Arena *a, size_t n, size_t align) {
+    uintptr_t p = ((uintptr_t)a->cur + align - 1) & ~(uintptr_t)(align - 1);
+    if (!a->cur || p + n > (uintptr_t)a->end) {
+        arena_new_chunk(a, n + align);
+        p = ((uintptr_t)a->cur + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    a->cur = (unsigned char *)(p + n);
+    a->stats.used += n;
+    return (void *)p;
+}
+
+static void arena_free(Arena *a) {
+    ArenaChunk *c = a->chunks;
+    while (c) {
+        ArenaChunk *next = c->next;
+        if (c->mapped) {
+            munmap(c, c->size);
+        } else {
+            free(c);
+        }
+        c = next;
+    }
+    a->chunks = NULL;
+    a->cur = a->end = NULL;
+}
+
+static inline const char *key_bytes(const KeyStore *k, size_t len) {
+    return len <= INLINE_KEY_MAX ? k->inl : k->ptr;
+}
+
+static void key_store(Arena *a, KeyStore *k, const char *key, size_t len) {
+    char *d = k->inl;
+    if (len > INLINE_KEY_MAX) {
+        d = (char *)arena_alloc(a, len + 1, 1);
+        k->ptr = d;
+    }
+    memcpy(d, key, len);
+    d[len] = '\0';
+}
+
+static inline const char *entry_key(const Entry *e) {
+    return key_bytes(&e->key, e->len);
+}
+
+static inline const char *slot_key(const Slot *s) {
+    return key_bytes(&s->key, s->len);
+}
+
+static void chained_init(HashTable *t, size_t buckets) {
     t->bucket_count = buckets;
-    t->size = 0;
     t->buckets = (Entry **)calloc(buckets, sizeof(Entry *));
     if (!t->buckets) {
         die("Out of memory");
     }
 }
 
-static void table_free(HashTable *t) {
-    for (size_t i = 0; i < t->bucket_count; ++i) {
-        Entry *e = t->buckets[i];
-        while (e) {
-            Entry *next = e->next;
-            free(e->key);
-            free(e);
-            e = next;
-        }
-    }
+static void chained_free(HashTable *t) {
     free(t->buckets);
 }
 
-static void table_rehash(HashTable *t) {
+static void chained_rehash(HashTable *t) {
     size_t new_count = t->bucket_count * 2;
     Entry **new_buckets = (Entry **)calloc(new_count, sizeof(Entry *));
     if (!new_buckets) {
@@ -87,8 +357,7 @@ static void table_rehash(HashTable *t) {
         Entry *e = t->buckets[i];
         while (e) {
             Entry *next = e->next;
-            uint64_t h = hash_str(e->key);
-            size_t idx = (size_t)(h % new_count);
+            size_t idx = (size_t)(e->hash % new_count);
             e->next = new_buckets[idx];
             new_buckets[idx] = e;
             e = next;
@@ -100,315 +369,5322 @@ static void table_rehash(HashTable *t) {
     t->bucket_count = new_count;
 }
 
-static void table_inc(HashTable *t, const char *key) {
+static uint64_t *chained_count(HashTable *t, const char *key, size_t len, uint64_t h) {
     if ((t->size * LOAD_FACTOR_DEN) >= (t->bucket_count * LOAD_FACTOR_NUM)) {
-        table_rehash(t);
+        chained_rehash(t);
     }
 
-    uint64_t h = hash_str(key);
     size_t idx = (size_t)(h % t->bucket_count);
     Entry *e = t->buckets[idx];
     while (e) {
-        if (strcmp(e->key, key) == 0) {
-            e->count++;
-            return;
+        if (e->hash == h && e->len == len && memcmp(entry_key(e), key, len) == 0) {
+            return &e->count;
         }
         e = e->next;
     }
 
-    Entry *n = (Entry *)xmalloc(sizeof(Entry));
-    n->key = xstrdup(key);
-    n->count = 1;
-    n->next = t->buckets[idx];
-    t->buckets[idx] = n;
+    Entry *ne = (Entry *)arena_alloc(&t->arena, sizeof(Entry), _Alignof(Entry));
+    key_store(&t->arena, &ne->key, key, len);
+    ne->hash = h;
+    ne->len = len;
+    ne->count = 0;
+    ne->next = t->buckets[idx];
+    t->buckets[idx] = ne;
     t->size++;
+    return &ne->count;
 }
 
-static int skip_ws(FILE *fp) {
-    int c;
-    do {
-        c = fgetc(fp);
-    } while (c != EOF && isspace((unsigned char)c));
-    return c;
+/* Bit i is set when control byte i of the group equals b. */
+static inline unsigned group_match(const uint8_t *ctrl, uint8_t b) {
+#if defined(__x86_64__)
+    __m128i g = _mm_loadu_si128((const __m128i *)(const void *)ctrl);
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+    unsigned m = 0;
+    for (int i = 0; i < SWISS_GROUP; ++i) {
+        if (ctrl[i] == b) m |= 1u << i;
+    }
+    return m;
+#endif
 }
 
-static char *read_json_string(FILE *fp) {
-    size_t cap = 32;
-    size_t len = 0;
-    char *buf = (char *)xmalloc(cap);
-
-    for (;;) {
-        int c = fgetc(fp);
-        if (c == EOF) {
-            free(buf);
-            return NULL;
-        }
-        if (c == '"') {
-            buf[len] = '\0';
-            return buf;
-        }
-        if (c == '\\') {
-            int esc = fgetc(fp);
-            if (esc == EOF) {
-                free(buf);
-                return NULL;
-            }
-            if (esc == 'u') {
-                for (int i = 0; i < 4; ++i) {
-                    int h = fgetc(fp);
-                    if (h == EOF || !isxdigit((unsigned char)h)) {
-                        free(buf);
-                        return NULL;
-                    }
-                }
-                c = '?';
-            } else {
-                switch (esc) {
-                    case '"': c = '"'; break;
-                    case '\\': c = '\\'; break;
-                    case '/': c = '/'; break;
-                    case 'b': c = '\b'; break;
-                    case 'f': c = '\f'; break;
-                    case 'n': c = '\n'; break;
-                    case 'r': c = '\r'; break;
-                    case 't': c = '\t'; break;
-                    default: c = esc; break;
-                }
-            }
-        }
+static void swiss_init(HashTable *t, size_t capacity) {
+    size_t cap = SWISS_GROUP;
+    while (cap < capacity) cap *= 2;
+    t->capacity = cap;
+    t->growth_left = cap / SWISS_LOAD_DEN * SWISS_LOAD_NUM;
+    t->ctrl = (uint8_t *)xmalloc(cap);
+    memset(t->ctrl, CTRL_EMPTY, cap);
+    t->slots = (Slot *)xmalloc(cap * sizeof(Slot));
+}
 
-        if (len + 1 >= cap) {
-            cap *= 2;
-            char *tmp = (char *)realloc(buf, cap);
-            if (!tmp) {
-                free(buf);
-                die("Out of memory");
-            }
-            buf = tmp;
-        }
-        buf[len++] = (char)c;
-    }
+static void swiss_free(HashTable *t) {
+    free(t->ctrl);
+    free(t->slots);
 }
 
-static int consume_json_value(FILE *fp, int first) {
-    int c = first;
+/* Probe sequence: hash >> 7 picks the first group, the low 7 bits are the
+ * control byte, and groups are visited in triangular steps, which covers
+ * every group of a power-of-two table. */
+static inline size_t swiss_first_group(const HashTable *t, uint64_t h) {
+    return (size_t)(h >> 7) & (t->capacity / SWISS_GROUP - 1);
+}
 
-    if (c == '"') {
-        char *s = read_json_string(fp);
-        if (!s) return 0;
-        free(s);
-        return 1;
+/* Index of the first empty slot on h's probe sequence. */
+static size_t swiss_find_empty(const HashTable *t, uint64_t h) {
+    size_t gmask = t->capacity / SWISS_GROUP - 1;
+    size_t g = swiss_first_group(t, h);
+    for (size_t step = 1;; ++step) {
+        unsigned empty = group_match(t->ctrl + g * SWISS_GROUP, CTRL_EMPTY);
+        if (empty) return g * SWISS_GROUP + (size_t)__builtin_ctz(empty);
+        g = (g + step) & gmask;
     }
+}
 
-    if (c == '{' || c == '[') {
-        int depth = 1;
-        int in_string = 0;
-        int esc = 0;
-        while (depth > 0) {
-            c = fgetc(fp);
-            if (c == EOF) return 0;
+static void swiss_grow(HashTable *t) {
+    /* Slots move, so cached counter pointers go stale. */
+    memset(t->front.slots, 0, sizeof(t->front.slots));
 
-            if (in_string) {
-                if (esc) {
-                    esc = 0;
-                } else if (c == '\\') {
-                    esc = 1;
-                } else if (c == '"') {
-                    in_string = 0;
-                }
-                continue;
-            }
+    uint8_t *old_ctrl = t->ctrl;
+    Slot *old_slots = t->slots;
+    size_t old_cap = t->capacity;
 
-            if (c == '"') {
-                in_string = 1;
-            } else if (c == '{' || c == '[') {
-                depth++;
-            } else if (c == '}' || c == ']') {
-                depth--;
-            }
-        }
-        return 1;
+    swiss_init(t, old_cap * 2);
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old_ctrl[i] == CTRL_EMPTY) continue;
+        size_t j = swiss_find_empty(t, old_slots[i].hash);
+        t->ctrl[j] = old_ctrl[i];
+        t->slots[j] = old_slots[i];
+        t->growth_left--;
     }
+    free(old_ctrl);
+    free(old_slots);
+}
 
-    while (c != EOF && c != ',' && c != '}' && c != ']' && !isspace((unsigned char)c)) {
-        c = fgetc(fp);
-    }
-    if (c == ',' || c == '}' || c == ']') {
-        ungetc(c, fp);
+/* Slot holding key, or NULL.  Groups are searched until one with an empty
+ * slot: keys are never removed, so an insert always lands in the first such
+ * group and the key cannot be further along. */
+static Slot *swiss_find(const HashTable *t, const char *key, size_t len, uint64_t h) {
+    size_t gmask = t->capacity / SWISS_GROUP - 1;
+    uint8_t h2 = (uint8_t)(h & 0x7f);
+    size_t g = swiss_first_group(t, h);
+    for (size_t step = 1;; ++step) {
+        const uint8_t *ctrl = t->ctrl + g * SWISS_GROUP;
+        for (unsigned m = group_match(ctrl, h2); m; m &= m - 1) {
+            Slot *s = &t->slots[g * SWISS_GROUP + (size_t)__builtin_ctz(m)];
+            if (s->hash == h && s->len == len && memcmp(slot_key(s), key, len) == 0) return s;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return NULL;
+        g = (g + step) & gmask;
     }
-    return 1;
 }
 
+static uint64_t *swiss_count(HashTable *t, const char *key, size_t len, uint64_t h) {
+    Slot *s = swiss_find(t, key, len, h);
+    if (s) return &s->count;
+
+    if (t->growth_left == 0) swiss_grow(t);
+    size_t i = swiss_find_empty(t, h);
+    t->ctrl[i] = (uint8_t)(h & 0x7f);
+    s = &t->slots[i];
+    s->hash = h;
+    key_store(&t->arena, &s->key, key, len);
+    s->len = len;
+    s->count = 0;
+    t->growth_left--;
+    t->size++;
+    return &s->count;
+}
+
+/*
+ * Approximate counting (--approx=K) in fixed memory.  A HyperLogLog sketch
+ * estimates the number of distinct models, and a Space-Saving summary of K
+ * counters keeps the heavy hitters.  A tracked count overestimates the true
+ * one by at most its recorded error, and any model seen more than N/K times
+ * out of N is tracked.  While fewer than K models have been seen nothing
+ * is evicted and every figure is exact.  Sketches of different scanners
+ * merge: HLL registers by maximum, Space-Saving summaries as in Agarwal et
+ * al., "Mergeable Summaries".
+ */
+#define HLL_BITS 14
+#define HLL_REGISTERS (1u << HLL_BITS)
+#define APPROX_K_DEFAULT 1000
+
 typedef struct {
-    double start_time;
-    double last_time;
-    uint64_t last_models_seen;
-} ProgressState;
+    char *key;
+    size_t len;
+    size_t cap;
+    uint64_t hash;
+    uint64_t count;  /* upper bound */
+    uint64_t error;  /* count - error is a lower bound */
+    size_t heap;     /* position in Approx.heap */
+} SSCounter;
 
-static double now_seconds(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+typedef struct Approx {
+    uint8_t hll[HLL_REGISTERS];
+    uint64_t total;       /* keys added */
+    SSCounter *counters;  /* k of them, the first `used` live */
+    size_t k;
+    size_t used;
+    uint32_t *heap;       /* counter indices, min-heap on count */
+    uint32_t *slots;      /* linear probing on hash: counter index + 1, 0 if empty */
+    size_t mask;
+} Approx;
+
+static size_t g_approx_k = 0;  /* 0 for exact counting */
+
+static Approx *approx_new(size_t k) {
+    Approx *a = (Approx *)xmalloc(sizeof(Approx));
+    memset(a, 0, sizeof(*a));
+    a->k = k;
+    a->counters = (SSCounter *)calloc(k, sizeof(SSCounter));
+    a->heap = (uint32_t *)xmalloc(k * sizeof(uint32_t));
+    size_t slots = 4;
+    while (slots < 2 * k) slots *= 2;
+    a->slots = (uint32_t *)calloc(slots, sizeof(uint32_t));
+    if (!a->counters || !a->slots) die("Out of memory");
+    a->mask = slots - 1;
+    return a;
 }
 
-static void print_progress_with_pct(FILE *fp, uint64_t models_seen, size_t unique_models,
-                                    ProgressState *progress, long total_bytes) {
-    long pos = ftell(fp);
-    double pct = 0.0;
-    if (total_bytes > 0 && pos >= 0) {
-        pct = 100.0 * (double)pos / (double)total_bytes;
-        if (pct > 100.0) pct = 100.0;
+static void approx_free(Approx *a) {
+    for (size_t i = 0; i < a->used; ++i) {
+        free(a->counters[i].key);
     }
+    free(a->counters);
+    free(a->heap);
+    free(a->slots);
+    free(a);
+}
 
-    FILE *mem = fopen("/proc/self/statm", "r");
-    if (!mem) {
-        return;
+/* Slot holding key, or the empty slot where it would go. */
+static size_t ss_slot(const Approx *a, const char *key, size_t len, uint64_t h) {
+    size_t i = (size_t)h & a->mask;
+    for (; a->slots[i]; i = (i + 1) & a->mask) {
+        const SSCounter *c = &a->counters[a->slots[i] - 1];
+        if (c->hash == h && c->len == len && memcmp(c->key, key, len) == 0) break;
     }
+    return i;
+}
 
-    unsigned long size_pages = 0;
-    unsigned long rss_pages = 0;
-    if (fscanf(mem, "%lu %lu", &size_pages, &rss_pages) == 2) {
-        long page_size = sysconf(_SC_PAGESIZE);
-        if (page_size > 0) {
-            double t = now_seconds();
-            double elapsed_total = t - progress->start_time;
-            double elapsed_interval = t - progress->last_time;
-            (void)elapsed_total;
-            double interval_speed = elapsed_interval > 0.0
-                ? (double)(models_seen - progress->last_models_seen) / elapsed_interval
-                : 0.0;
-            double rss_mb = (double)rss_pages * (double)page_size / (1024.0 * 1024.0);
-            fprintf(stderr,
-                    "\r%.2f%% processed, %llu models, unique %zu, RSS %.2f MB, speed %.0f models/s",
-                    pct, (unsigned long long)models_seen, unique_models, rss_mb, interval_speed);
-            fflush(stderr);
-            progress->last_time = t;
-            progress->last_models_seen = models_seen;
+/* Empties slot i, moving later entries of its probe run back into the gap. */
+static void ss_slot_remove(Approx *a, size_t i) {
+    size_t j = i;
+    for (;;) {
+        a->slots[i] = 0;
+        for (;;) {
+            j = (j + 1) & a->mask;
+            if (!a->slots[j]) return;
+            size_t home = (size_t)a->counters[a->slots[j] - 1].hash & a->mask;
+            /* Stays when its home lies cyclically in (i, j]. */
+            if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
         }
+        a->slots[i] = a->slots[j];
+        i = j;
     }
+}
 
-    fclose(mem);
+static void ss_heap_swap(Approx *a, size_t x, size_t y) {
+    uint32_t t = a->heap[x];
+    a->heap[x] = a->heap[y];
+    a->heap[y] = t;
+    a->counters[a->heap[x]].heap = x;
+    a->counters[a->heap[y]].heap = y;
 }
 
-static int process_file(FILE *fp, HashTable *table, uint64_t *models_seen, ProgressState *progress, long total_bytes) {
-    int c;
-    while ((c = fgetc(fp)) != EOF) {
-        if (c != '"') continue;
+static void ss_sift_down(Approx *a, size_t i) {
+    for (;;) {
+        size_t m = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        if (l < a->used && a->counters[a->heap[l]].count < a->counters[a->heap[m]].count) m = l;
+        if (r < a->used && a->counters[a->heap[r]].count < a->counters[a->heap[m]].count) m = r;
+        if (m == i) return;
+        ss_heap_swap(a, i, m);
+        i = m;
+    }
+}
 
-        char *key = read_json_string(fp);
-        if (!key) return 0;
+static void ss_sift_up(Approx *a, size_t i) {
+    while (i > 0 && a->counters[a->heap[(i - 1) / 2]].count > a->counters[a->heap[i]].count) {
+        ss_heap_swap(a, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
 
-        c = skip_ws(fp);
-        if (c != ':') {
-            free(key);
-            continue;
-        }
+static void ss_set_key(SSCounter *c, const char *key, size_t len, uint64_t h) {
+    if (len + 1 > c->cap) {
+        free(c->key);
+        c->cap = len + 1;
+        c->key = (char *)xmalloc(c->cap);
+    }
+    memcpy(c->key, key, len);
+    c->key[len] = '\0';
+    c->len = len;
+    c->hash = h;
+}
 
-        c = skip_ws(fp);
-        if (c == EOF) {
-            free(key);
-            break;
-        }
+/* Starts tracking a key that is not tracked yet, evicting the smallest
+ * counter when all K are in use. */
+static void ss_insert(Approx *a, size_t slot, const char *key, size_t len, uint64_t h, uint64_t count,
+                      uint64_t error) {
+    size_t ci;
+    if (a->used < a->k) {
+        ci = a->used;
+        a->heap[a->used] = (uint32_t)ci;
+        a->counters[ci].heap = a->used++;
+    } else {
+        ci = a->heap[0];
+        ss_slot_remove(a, ss_slot(a, a->counters[ci].key, a->counters[ci].len, a->counters[ci].hash));
+        slot = ss_slot(a, key, len, h);
+    }
+    SSCounter *c = &a->counters[ci];
+    ss_set_key(c, key, len, h);
+    c->count = count;
+    c->error = error;
+    a->slots[slot] = (uint32_t)ci + 1;
+    ss_sift_up(a, c->heap);
+    ss_sift_down(a, c->heap);
+}
 
-        if (strcmp(key, KEY_MODEL) == 0 && c == '"') {
-            char *val = read_json_string(fp);
-            if (!val) {
-                free(key);
-                return 0;
-            }
-            table_inc(table, val);
-            (*models_seen)++;
-            if ((now_seconds() - progress->last_time) >= PROGRESS_INTERVAL_SEC) {
-                print_progress_with_pct(fp, *models_seen, table->size, progress, total_bytes);
-            }
-            free(val);
-        } else {
-            if (!consume_json_value(fp, c)) {
-                free(key);
-                return 0;
-            }
-        }
+static void approx_add(Approx *a, const char *key, size_t len) {
+    uint64_t h = hash_bytes(key, len);
+    uint64_t w = h << HLL_BITS;
+    uint8_t rank = w ? (uint8_t)(__builtin_clzll(w) + 1) : (uint8_t)(64 - HLL_BITS + 1);
+    uint8_t *reg = &a->hll[h >> (64 - HLL_BITS)];
+    if (rank > *reg) *reg = rank;
+    a->total++;
 
-        free(key);
+    size_t slot = ss_slot(a, key, len, h);
+    if (a->slots[slot]) {
+        SSCounter *c = &a->counters[a->slots[slot] - 1];
+        c->count++;
+        ss_sift_down(a, c->heap);
+    } else if (a->used < a->k) {
+        ss_insert(a, slot, key, len, h, 1, 0);
+    } else {
+        uint64_t min = a->counters[a->heap[0]].count;
+        ss_insert(a, slot, key, len, h, min + 1, min);
     }
+}
 
-    return 1;
+/* HyperLogLog estimate from `count` registers, with linear counting for
+ * small cardinalities. */
+static uint64_t hll_registers_estimate(const uint8_t *reg, size_t count) {
+    double m = (double)count;
+    double sum = 0.0;
+    unsigned zeros = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += ldexp(1.0, -(int)reg[i]);
+        zeros += reg[i] == 0;
+    }
+    double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) e = m * log(m / (double)zeros);
+    return (uint64_t)(e + 0.5);
 }
 
-typedef struct {
-    const char *key;
-    uint64_t count;
-} Pair;
+static uint64_t hll_estimate(const Approx *a) {
+    return hll_registers_estimate(a->hll, HLL_REGISTERS);
+}
 
-#ifndef MODEL_COUNT_NO_MAIN
-static int pair_cmp(const void *a, const void *b) {
-    const Pair *pa = (const Pair *)a;
-    const Pair *pb = (const Pair *)b;
-    if (pa->count < pb->count) return 1;
-    if (pa->count > pb->count) return -1;
-    return strcmp(pa->key, pb->key);
+/* Relative standard error of hll_estimate(). */
+static double hll_error(void) {
+    return 1.04 / sqrt((double)HLL_REGISTERS);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <file.json>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
+static int counter_cmp(const void *x, const void *y) {
+    const SSCounter *a = (const SSCounter *)x;
+    const SSCounter *b = (const SSCounter *)y;
+    if (a->count != b->count) return a->count < b->count ? 1 : -1;
+    return strcmp(a->key, b->key);
+}
 
-    const char *path = argv[1];
-    FILE *fp = fopen(path, "rb");
-    if (!fp) {
-        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
-        return EXIT_FAILURE;
+/* Folds src into dst.  A key missing from a full summary may have occurred
+ * up to that summary's smallest count, so it is charged that much as both
+ * count and error; the K largest results are kept. */
+static void approx_merge(Approx *dst, const Approx *src) {
+    for (size_t i = 0; i < HLL_REGISTERS; ++i) {
+        if (src->hll[i] > dst->hll[i]) dst->hll[i] = src->hll[i];
     }
+    dst->total += src->total;
 
-    HashTable table;
-    uint64_t models_seen = 0;
-    long total_bytes = 0;
-    ProgressState progress = {0};
-    progress.start_time = now_seconds();
-    progress.last_time = progress.start_time;
-    progress.last_models_seen = 0;
-    table_init(&table, INITIAL_BUCKETS);
-
-    if (fseek(fp, 0, SEEK_END) == 0) {
-        long end = ftell(fp);
-        if (end > 0) total_bytes = end;
-        fseek(fp, 0, SEEK_SET);
+    uint64_t dst_min = dst->used == dst->k ? dst->counters[dst->heap[0]].count : 0;
+    uint64_t src_min = src->used == src->k ? src->counters[src->heap[0]].count : 0;
+    SSCounter *all = (SSCounter *)xmalloc((dst->used + src->used + 1) * sizeof(SSCounter));
+    size_t n = 0;
+    for (size_t i = 0; i < dst->used; ++i) {
+        all[n] = dst->counters[i];
+        size_t slot = ss_slot(src, all[n].key, all[n].len, all[n].hash);
+        const SSCounter *s = src->slots[slot] ? &src->counters[src->slots[slot] - 1] : NULL;
+        all[n].count += s ? s->count : src_min;
+        all[n].error += s ? s->error : src_min;
+        n++;
+    }
+    for (size_t i = 0; i < src->used; ++i) {
+        const SSCounter *s = &src->counters[i];
+        if (dst->slots[ss_slot(dst, s->key, s->len, s->hash)]) continue;
+        all[n] = *s;
+        all[n].key = (char *)xmalloc(s->len + 1);
+        memcpy(all[n].key, s->key, s->len + 1);
+        all[n].cap = s->len + 1;
+        all[n].count += dst_min;
+        all[n].error += dst_min;
+        n++;
     }
 
-    if (!process_file(fp, &table, &models_seen, &progress, total_bytes)) {
-        fprintf(stderr, "Parse error while reading '%s'\n", path);
-        fclose(fp);
-        table_free(&table);
-        return EXIT_FAILURE;
+    qsort(all, n, sizeof(SSCounter), counter_cmp);
+    size_t keep = n < dst->k ? n : dst->k;
+    for (size_t i = keep; i < n; ++i) {
+        free(all[i].key);
     }
+    memcpy(dst->counters, all, keep * sizeof(SSCounter));
+    dst->used = keep;
+    memset(dst->slots, 0, (dst->mask + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < keep; ++i) {
+        SSCounter *c = &dst->counters[i];
+        dst->slots[ss_slot(dst, c->key, c->len, c->hash)] = (uint32_t)i + 1;
+        dst->heap[i] = (uint32_t)i;
+        c->heap = i;
+    }
+    for (size_t i = keep / 2; i-- > 0;) {
+        ss_sift_down(dst, i);
+    }
+    free(all);
+}
 
-    if (progress.last_models_seen > 0) {
-        fputc('\n', stderr);
+/* `buckets` is the initial capacity hint for either engine. */
+static void table_init(HashTable *t, size_t buckets) {
+    memset(t, 0, sizeof(*t));
+    t->engine = g_table_engine;
+    arena_init(&t->arena);
+    if (t->engine == TABLE_SWISS) {
+        swiss_init(t, buckets);
+    } else {
+        chained_init(t, buckets);
     }
+}
 
-    fclose(fp);
+static int g_distinct = 0;          /* --distinct: keep Distinct sketches */
+static int64_t g_bucket_width = 0;  /* --bucket-by: seconds per bucket, 0 for none */
 
-    Pair *pairs = (Pair *)xmalloc(table.size * sizeof(Pair));
-    size_t idx = 0;
-    for (size_t i = 0; i < table.bucket_count; ++i) {
-        for (Entry *e = table.buckets[i]; e; e = e->next) {
-            pairs[idx].key = e->key;
-            pairs[idx].count = e->count;
-            idx++;
-        }
-    }
+static struct Distinct *distinct_new(void);
+static void distinct_free(struct Distinct *d);
+static struct Series *series_new(void);
+static void series_free(struct Series *s);
 
-    qsort(pairs, table.size, sizeof(Pair), pair_cmp);
+/* A table for model counts: exact, or a sketch under --approx, and with
+ * distinct counts under --distinct. */
+static void counts_init(HashTable *t) {
+    table_init(t, INITIAL_BUCKETS);
+    if (g_approx_k) t->approx = approx_new(g_approx_k);
+    if (g_distinct) t->distinct = distinct_new();
+    if (g_bucket_width) t->series = series_new();
+}
 
-    printf("Unique models: %zu\n", table.size);
-    for (size_t i = 0; i < table.size; ++i) {
-        printf("%s: %llu\n", pairs[i].key, (unsigned long long)pairs[i].count);
+/* Entries and keys go with the arena, so teardown is O(chunks). */
+static void table_free(HashTable *t) {
+    if (t->approx) approx_free(t->approx);
+    if (t->distinct) distinct_free(t->distinct);
+    if (t->series) series_free(t->series);
+    if (t->engine == TABLE_SWISS) {
+        swiss_free(t);
+    } else {
+        chained_free(t);
     }
+    arena_free(&t->arena);
+}
 
-    free(pairs);
+/* Counter for key (hash being hash_bytes(key, len)), inserted at zero when
+ * absent.  The pointer is valid until the next insert. */
+static inline uint64_t *table_count(HashTable *t, const char *key, size_t len, uint64_t hash) {
+    return t->engine == TABLE_SWISS ? swiss_count(t, key, len, hash) : chained_count(t, key, len, hash);
+}
+
+static inline void table_add(HashTable *t, const char *key, size_t len, uint64_t hash, uint64_t n) {
+    *table_count(t, key, len, hash) += n;
+}
+
+/* Counter for key, or NULL when it is absent. */
+static const uint64_t *table_find(const HashTable *t, const char *key, size_t len, uint64_t hash) {
+    if (t->engine == TABLE_SWISS) {
+        const Slot *s = swiss_find(t, key, len, hash);
+        return s ? &s->count : NULL;
+    }
+    for (const Entry *e = t->buckets[hash % t->bucket_count]; e; e = e->next) {
+        if (e->hash == hash && e->len == len && memcmp(entry_key(e), key, len) == 0) return &e->count;
+    }
+    return NULL;
+}
+
+static inline uint64_t front_prefix(const char *key, size_t len) {
+    uint64_t w = 0;
+    memcpy(&w, key, len < 8 ? len : 8);
+    return w;
+}
+
+static inline FrontSlot *front_slot(HashTable *t, size_t len, uint64_t prefix) {
+    uint64_t h = (prefix ^ len) * 0x9e3779b97f4a7c15ULL;
+    return &t->front.slots[h >> (64 - 6)];
+}
+
+/* Counts one occurrence of key, trying the front cache before hashing. */
+static inline void table_add_one(HashTable *t, const char *key, size_t len) {
+    if (t->approx) {
+        approx_add(t->approx, key, len);
+        return;
+    }
+    FrontCache *fc = &t->front;
+    if (!g_front_cache || fc->bypass) {
+        fc->bypass -= fc->bypass != 0;
+        table_add(t, key, len, hash_bytes(key, len), 1);
+        return;
+    }
+
+    uint64_t prefix = front_prefix(key, len);
+    FrontSlot *fs = front_slot(t, len, prefix);
+    if (++fc->lookups == FRONT_WINDOW) {
+        if (fc->hits < FRONT_WINDOW / 2) fc->bypass = FRONT_BACKOFF;
+        fc->lookups = 0;
+        fc->hits = 0;
+    }
+    if (fs->count && fs->len == len && fs->prefix == prefix &&
+        (len <= 8 || memcmp(fs->key + 8, key + 8, len - 8) == 0)) {
+        fc->hits++;
+        ++*fs->count;
+        return;
+    }
+
+    uint64_t *count = table_count(t, key, len, hash_bytes(key, len));
+    ++*count;
+    /* The counter sits in the entry or slot that also holds the key. */
+    if (t->engine == TABLE_SWISS) {
+        const Slot *s = (const Slot *)(const void *)((char *)count - offsetof(Slot, count));
+        fs->key = slot_key(s);
+    } else {
+        const Entry *e = (const Entry *)(const void *)((char *)count - offsetof(Entry, count));
+        fs->key = entry_key(e);
+    }
+    fs->len = len;
+    fs->prefix = prefix;
+    fs->count = count;
+}
+
+typedef struct {
+    const char *key;  /* NUL terminated */
+    size_t len;
+    uint64_t hash;
+    uint64_t count;
+} EntryView;
+
+typedef void (*EntryFn)(const EntryView *e, void *ctx);
+
+/* Calls fn for the entries in slice `part` of `parts` equal slices of the
+ * table, in table order. */
+static void table_foreach_part(const HashTable *t, size_t part, size_t parts, EntryFn fn, void *ctx) {
+    EntryView v;
+    if (t->engine == TABLE_SWISS) {
+        size_t end = t->capacity * (part + 1) / parts;
+        for (size_t i = t->capacity * part / parts; i < end; ++i) {
+            if (t->ctrl[i] == CTRL_EMPTY) continue;
+            const Slot *s = &t->slots[i];
+            v.key = slot_key(s);
+            v.len = s->len;
+            v.hash = s->hash;
+            v.count = s->count;
+            fn(&v, ctx);
+        }
+        return;
+    }
+    size_t end = t->bucket_count * (part + 1) / parts;
+    for (size_t i = t->bucket_count * part / parts; i < end; ++i) {
+        for (const Entry *e = t->buckets[i]; e; e = e->next) {
+            v.key = entry_key(e);
+            v.len = e->len;
+            v.hash = e->hash;
+            v.count = e->count;
+            fn(&v, ctx);
+        }
+    }
+}
+
+/* Calls fn for every entry, in table order. */
+static void table_foreach(const HashTable *t, EntryFn fn, void *ctx) {
+    table_foreach_part(t, 0, 1, fn, ctx);
+}
+
+/*
+ * Distinct counts per key (--distinct=PATH): beside the count of each key,
+ * a HyperLogLog sketch of the values of a second field, such as serials per
+ * model.  A sketch starts sparse, as a sorted list of its nonzero registers,
+ * and turns into a dense register array only once that list would take a
+ * quarter of the array's size, so the many rare keys stay small.  The
+ * sketches of a table live in a side table whose counters hold sketch
+ * numbers, leaving the entries of every other table as they are.  Sketches
+ * merge register by register, across threads and files alike.
+ */
+#define DISTINCT_BITS 12
+#define DISTINCT_REGISTERS (1u << DISTINCT_BITS)
+#define DISTINCT_SPARSE_MAX (DISTINCT_REGISTERS / 16)
+
+typedef struct {
+    uint8_t *dense;    /* DISTINCT_REGISTERS registers, or NULL while sparse */
+    uint32_t *sparse;  /* register << 8 | value, sorted */
+    uint32_t len;
+    uint32_t cap;
+} Hll;
+
+typedef struct Distinct {
+    HashTable ids;     /* key -> sketch number + 1 */
+    Hll *sketches;
+    size_t len;
+    size_t cap;
+} Distinct;
+
+static Distinct *distinct_new(void) {
+    Distinct *d = (Distinct *)xmalloc(sizeof(Distinct));
+    table_init(&d->ids, INITIAL_BUCKETS);
+    d->sketches = NULL;
+    d->len = 0;
+    d->cap = 0;
+    return d;
+}
+
+static void distinct_free(Distinct *d) {
+    for (size_t i = 0; i < d->len; ++i) {
+        free(d->sketches[i].dense);
+        free(d->sketches[i].sparse);
+    }
+    free(d->sketches);
+    table_free(&d->ids);
+    free(d);
+}
+
+static void hll_densify(Hll *h) {
+    h->dense = (uint8_t *)calloc(DISTINCT_REGISTERS, 1);
+    if (!h->dense) die("Out of memory");
+    for (uint32_t i = 0; i < h->len; ++i) {
+        h->dense[h->sparse[i] >> 8] = (uint8_t)h->sparse[i];
+    }
+    free(h->sparse);
+    h->sparse = NULL;
+    h->len = h->cap = 0;
+}
+
+/* Raises register reg to at least value. */
+static void hll_set(Hll *h, uint32_t reg, uint8_t value) {
+    if (h->dense) {
+        if (value > h->dense[reg]) h->dense[reg] = value;
+        return;
+    }
+    uint32_t lo = 0;
+    uint32_t hi = h->len;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if ((h->sparse[mid] >> 8) < reg) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < h->len && (h->sparse[lo] >> 8) == reg) {
+        if (value > (uint8_t)h->sparse[lo]) h->sparse[lo] = reg << 8 | value;
+        return;
+    }
+    if (h->len == DISTINCT_SPARSE_MAX) {
+        hll_densify(h);
+        h->dense[reg] = value;
+        return;
+    }
+    if (h->len == h->cap) {
+        h->cap = h->cap ? 2 * h->cap : 4;
+        uint32_t *tmp = (uint32_t *)realloc(h->sparse, h->cap * sizeof(uint32_t));
+        if (!tmp) die("Out of memory");
+        h->sparse = tmp;
+    }
+    memmove(&h->sparse[lo + 1], &h->sparse[lo], (h->len - lo) * sizeof(uint32_t));
+    h->sparse[lo] = reg << 8 | value;
+    h->len++;
+}
+
+static void hll_add(Hll *h, uint64_t hash) {
+    uint64_t w = hash << DISTINCT_BITS;
+    uint8_t rank = w ? (uint8_t)(__builtin_clzll(w) + 1) : (uint8_t)(64 - DISTINCT_BITS + 1);
+    hll_set(h, (uint32_t)(hash >> (64 - DISTINCT_BITS)), rank);
+}
+
+static void hll_merge(Hll *dst, const Hll *src) {
+    if (src->dense) {
+        if (!dst->dense) hll_densify(dst);
+        for (uint32_t i = 0; i < DISTINCT_REGISTERS; ++i) {
+            if (src->dense[i] > dst->dense[i]) dst->dense[i] = src->dense[i];
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < src->len; ++i) {
+        hll_set(dst, src->sparse[i] >> 8, (uint8_t)src->sparse[i]);
+    }
+}
+
+static uint64_t hll_count(const Hll *h) {
+    if (h->dense) return hll_registers_estimate(h->dense, DISTINCT_REGISTERS);
+    uint8_t reg[DISTINCT_REGISTERS] = {0};
+    for (uint32_t i = 0; i < h->len; ++i) {
+        reg[h->sparse[i] >> 8] = (uint8_t)h->sparse[i];
+    }
+    return hll_registers_estimate(reg, DISTINCT_REGISTERS);
+}
+
+/* Sketch of key (hash being hash_bytes(key, len)), created empty when
+ * absent.  The pointer is valid until the next sketch is created. */
+static Hll *distinct_sketch(Distinct *d, const char *key, size_t len, uint64_t hash) {
+    uint64_t *id = table_count(&d->ids, key, len, hash);
+    if (!*id) {
+        if (d->len == d->cap) {
+            d->cap = d->cap ? 2 * d->cap : 64;
+            Hll *tmp = (Hll *)realloc(d->sketches, d->cap * sizeof(Hll));
+            if (!tmp) die("Out of memory");
+            d->sketches = tmp;
+        }
+        memset(&d->sketches[d->len], 0, sizeof(Hll));
+        *id = ++d->len;
+    }
+    return &d->sketches[*id - 1];
+}
+
+/* Estimated number of distinct values seen with key; 0 for an unknown key. */
+static uint64_t distinct_estimate(const Distinct *d, const char *key, size_t len, uint64_t hash) {
+    const uint64_t *id = table_find(&d->ids, key, len, hash);
+    return id ? hll_count(&d->sketches[*id - 1]) : 0;
+}
+
+typedef struct {
+    Distinct *dst;
+    const Distinct *src;
+} DistinctMerge;
+
+static void distinct_merge_entry(const EntryView *e, void *ctx) {
+    DistinctMerge *m = (DistinctMerge *)ctx;
+    hll_merge(distinct_sketch(m->dst, e->key, e->len, e->hash), &m->src->sketches[e->count - 1]);
+}
+
+static void distinct_merge(Distinct *dst, const Distinct *src) {
+    DistinctMerge m = {dst, src};
+    table_foreach(&src->ids, distinct_merge_entry, &m);
+}
+
+/*
+ * Time-bucketed counts (--bucket-by=PATH:WIDTH): per key, the counts in
+ * every bucket of WIDTH seconds.  Keys get numbers in order of appearance.
+ * Each bucket is a row with a short array of counters for the first
+ * SERIES_DENSE_KEYS key numbers, grown as they appear: the time x key matrix
+ * is meant for the few keys that make a readable matrix, and for those a
+ * counter is reached without hashing the key again.  Counts of later keys
+ * go to one table of (bucket, key number) cells shared by all rows, so
+ * memory stays in proportion to the nonzero cells however many keys there
+ * are.  Rows are found through a table on the bucket start, after a check
+ * of the previous record's row, since records mostly arrive in time order.
+ * The key totals stay in the table itself.
+ */
+#define SERIES_DENSE_KEYS 256
+
+typedef struct {
+    int64_t start;     /* seconds since the epoch */
+    size_t width;      /* counters allocated, at most SERIES_DENSE_KEYS */
+    uint64_t *counts;  /* by key number */
+} SeriesRow;
+
+typedef struct Series {
+    HashTable ids;     /* key -> key number + 1 */
+    HashTable starts;  /* bucket start, 8 bytes -> row number + 1 */
+    HashTable cells;   /* bucket start and key number, 16 bytes -> count */
+    SeriesRow *rows;
+    size_t len;
+    size_t cap;
+    size_t last;       /* row of the previous add */
+    uint64_t keys;
+} Series;
+
+static Series *series_new(void) {
+    Series *s = (Series *)xmalloc(sizeof(Series));
+    memset(s, 0, sizeof(*s));
+    table_init(&s->ids, INITIAL_BUCKETS);
+    table_init(&s->starts, INITIAL_BUCKETS);
+    table_init(&s->cells, INITIAL_BUCKETS);
+    return s;
+}
+
+static void series_free(Series *s) {
+    for (size_t i = 0; i < s->len; ++i) {
+        free(s->rows[i].counts);
+    }
+    free(s->rows);
+    table_free(&s->ids);
+    table_free(&s->starts);
+    table_free(&s->cells);
+    free(s);
+}
+
+static SeriesRow *series_row(Series *s, int64_t start) {
+    if (s->len && s->rows[s->last].start == start) return &s->rows[s->last];
+    char k[sizeof(start)];
+    memcpy(k, &start, sizeof(k));
+    uint64_t *row = table_count(&s->starts, k, sizeof(k), hash_bytes(k, sizeof(k)));
+    if (!*row) {
+        if (s->len == s->cap) {
+            s->cap = s->cap ? 2 * s->cap : 64;
+            SeriesRow *tmp = (SeriesRow *)realloc(s->rows, s->cap * sizeof(SeriesRow));
+            if (!tmp) die("Out of memory");
+            s->rows = tmp;
+        }
+        s->rows[s->len].start = start;
+        s->rows[s->len].width = 0;
+        s->rows[s->len].counts = NULL;
+        *row = ++s->len;
+    }
+    s->last = *row - 1;
+    return &s->rows[s->last];
+}
+
+/* The cells key of key number k in the bucket starting at start. */
+static void series_cell(char cell[16], int64_t start, uint64_t k) {
+    memcpy(cell, &start, 8);
+    memcpy(cell + 8, &k, 8);
+}
+
+/* Adds n to the counter of key number k in the bucket starting at start. */
+static void series_bump(Series *s, int64_t start, uint64_t k, uint64_t n) {
+    SeriesRow *row = series_row(s, start);
+    if (k >= SERIES_DENSE_KEYS) {
+        char cell[16];
+        series_cell(cell, start, k);
+        table_add(&s->cells, cell, sizeof(cell), hash_bytes(cell, sizeof(cell)), n);
+        return;
+    }
+    if (k >= row->width) {
+        size_t width = row->width ? row->width : 8;
+        while (width <= k) width *= 2;
+        uint64_t *tmp = (uint64_t *)realloc(row->counts, width * sizeof(uint64_t));
+        if (!tmp) die("Out of memory");
+        memset(tmp + row->width, 0, (width - row->width) * sizeof(uint64_t));
+        row->counts = tmp;
+        row->width = width;
+    }
+    row->counts[k] += n;
+}
+
+/* The counter of key number k in row. */
+static uint64_t series_get(const Series *s, const SeriesRow *row, uint64_t k) {
+    if (k < row->width) return row->counts[k];
+    if (k < SERIES_DENSE_KEYS) return 0;
+    char cell[16];
+    series_cell(cell, row->start, k);
+    const uint64_t *c = table_find(&s->cells, cell, sizeof(cell), hash_bytes(cell, sizeof(cell)));
+    return c ? *c : 0;
+}
+
+/* Adds n to the count of key (hash being hash_bytes(key, len)) in the
+ * bucket starting at start. */
+static void series_add(Series *s, const char *key, size_t len, uint64_t hash, int64_t start, uint64_t n) {
+    uint64_t *id = table_count(&s->ids, key, len, hash);
+    if (!*id) *id = ++s->keys;
+    series_bump(s, start, *id - 1, n);
+}
+
+typedef struct {
+    Series *dst;
+    uint64_t *map;     /* src key number -> dst key number + 1 */
+} SeriesMerge;
+
+static void series_merge_id(const EntryView *e, void *ctx) {
+    SeriesMerge *m = (SeriesMerge *)ctx;
+    uint64_t *id = table_count(&m->dst->ids, e->key, e->len, e->hash);
+    if (!*id) *id = ++m->dst->keys;
+    m->map[e->count - 1] = *id;
+}
+
+static void series_merge_cell(const EntryView *e, void *ctx) {
+    SeriesMerge *m = (SeriesMerge *)ctx;
+    int64_t start;
+    uint64_t k;
+    memcpy(&start, e->key, 8);
+    memcpy(&k, e->key + 8, 8);
+    series_bump(m->dst, start, m->map[k] - 1, e->count);
+}
+
+static void series_merge(Series *dst, const Series *src) {
+    SeriesMerge m = {dst, (uint64_t *)xmalloc((src->keys ? src->keys : 1) * sizeof(uint64_t))};
+    table_foreach(&src->ids, series_merge_id, &m);
+    for (size_t i = 0; i < src->len; ++i) {
+        const SeriesRow *row = &src->rows[i];
+        series_row(dst, row->start);
+        for (size_t k = 0; k < row->width; ++k) {
+            if (row->counts[k]) series_bump(dst, row->start, m.map[k] - 1, row->counts[k]);
+        }
+    }
+    table_foreach(&src->cells, series_merge_cell, &m);
+    free(m.map);
+}
+
+static void merge_entry(const EntryView *e, void *ctx) {
+    table_add((HashTable *)ctx, e->key, e->len, e->hash, e->count);
+}
+
+/* Adds every count in src to dst; sketches merge into sketches. */
+static void table_merge(HashTable *dst, const HashTable *src) {
+    if (src->approx) {
+        approx_merge(dst->approx, src->approx);
+        return;
+    }
+    table_foreach(src, merge_entry, dst);
+    if (src->distinct) distinct_merge(dst->distinct, src->distinct);
+    if (src->series) series_merge(dst->series, src->series);
+}
+
+/*
+ * Structural classification.
+ *
+ * The vectorized scanners look at input 64 bytes at a time: one pass over a
+ * block yields bitmasks of quotes, backslashes and brackets, and keys, values
+ * and nested containers are then skipped by bit-scanning those masks.  With
+ * SIMD_OFF the byte-at-a-time loops below are used unchanged; they are the
+ * reference the vector paths are tested against.
+ */
+enum { SIMD_OFF, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512, SIMD_AUTO };
+
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t open;   /* '{' or '[' */
+    uint64_t close;  /* '}' or ']' */
+} BlockMasks;
+
+typedef void (*ClassifyFn)(const unsigned char *p, BlockMasks *m);
+
+/* NULL selects the scalar reference scanners. */
+static ClassifyFn g_classify = NULL;
+
+static void classify_portable(const unsigned char *p, BlockMasks *m) {
+    memset(m, 0, sizeof(*m));
+    for (int i = 0; i < 64; ++i) {
+        uint64_t bit = 1ULL << i;
+        switch (p[i]) {
+            case '"': m->quote |= bit; break;
+            case '\\': m->backslash |= bit; break;
+            case '{': case '[': m->open |= bit; break;
+            case '}': case ']': m->close |= bit; break;
+            default: break;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+/* '[' and ']' differ from '{' and '}' only in bit 0x20, so OR-ing it in lets a
+ * single compare catch both brackets of a kind. */
+static void classify_sse2(const unsigned char *p, BlockMasks *m) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i fold = _mm_set1_epi8(0x20);
+    memset(m, 0, sizeof(*m));
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + 16 * i));
+        __m128i f = _mm_or_si128(v, fold);
+        int shift = 16 * i;
+        m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << shift;
+        m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)) << shift;
+        m->open |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(f, open)) << shift;
+        m->close |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(f, close)) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *p, BlockMasks *m) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(const void *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(const void *)(p + 32));
+    __m256i flo = _mm256_or_si256(lo, fold);
+    __m256i fhi = _mm256_or_si256(hi, fold);
+#define MASK64(a, b) ((uint64_t)(uint32_t)_mm256_movemask_epi8(a) | \
+                      (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32)
+    m->quote = MASK64(_mm256_cmpeq_epi8(lo, quote), _mm256_cmpeq_epi8(hi, quote));
+    m->backslash = MASK64(_mm256_cmpeq_epi8(lo, backslash), _mm256_cmpeq_epi8(hi, backslash));
+    m->open = MASK64(_mm256_cmpeq_epi8(flo, open), _mm256_cmpeq_epi8(fhi, open));
+    m->close = MASK64(_mm256_cmpeq_epi8(flo, close), _mm256_cmpeq_epi8(fhi, close));
+#undef MASK64
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void classify_avx512(const unsigned char *p, BlockMasks *m) {
+    __m512i v = _mm512_loadu_si512((const void *)p);
+    __m512i f = _mm512_or_si512(v, _mm512_set1_epi8(0x20));
+    m->quote = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'));
+    m->backslash = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+    m->open = _mm512_cmpeq_epi8_mask(f, _mm512_set1_epi8('{'));
+    m->close = _mm512_cmpeq_epi8_mask(f, _mm512_set1_epi8('}'));
+}
+#endif
+
+/* Installs the classifier for `level` (SIMD_AUTO picks the best the CPU
+ * supports) and returns the level actually selected, which is lower than the
+ * one asked for when the CPU lacks it. */
+static int simd_select(int level) {
+    int best = SIMD_OFF;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    best = SIMD_SSE2;
+    if (__builtin_cpu_supports("avx2")) best = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512bw")) best = SIMD_AVX512;
+#endif
+    if (level == SIMD_AUTO || level > best) level = best;
+
+    switch (level) {
+#if defined(__x86_64__)
+        case SIMD_SSE2: g_classify = classify_sse2; break;
+        case SIMD_AVX2: g_classify = classify_avx2; break;
+        case SIMD_AVX512: g_classify = classify_avx512; break;
+#endif
+        case SIMD_OFF: g_classify = NULL; break;
+        default: g_classify = classify_portable; break;
+    }
+    return level;
+}
+
+/* Bits of characters escaped by a preceding odd run of backslashes.  The
+ * carry holds whether the first byte of the next block is escaped. */
+static inline uint64_t find_escaped(uint64_t backslash, uint64_t *carry) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~*carry;
+    uint64_t follows_escape = backslash << 1 | *carry;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_sequences;
+    *carry = __builtin_add_overflow(odd_starts, backslash, &even_sequences);
+    uint64_t invert = even_sequences << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+/* Bit i is the parity of the set bits at positions 0..i. */
+static inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/* When set, regular files are mapped and scanned in place; otherwise every
+ * input goes through the buffered stdio path. */
+static int g_use_mmap = 1;
+
+/*
+ * Decompression.  gzip and zstd inputs are recognized by their magic bytes
+ * and inflated by a decoder thread into a small ring of output buffers,
+ * which the reader takes over as its windows, so decompression and parsing
+ * overlap.  Each buffer records how much compressed input had been consumed
+ * when it was produced; progress is reported against that.
+ */
+#define DEC_BUFFERS 4
+
+enum { DEC_GZIP, DEC_ZSTD };
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    uint64_t in_offset;  /* compressed bytes consumed at its end */
+} DecodedBuf;
+
+typedef struct Decoder {
+    int format;
+
+    /* Compressed input: a mapped range, or a stream whose first in_len bytes
+     * were already read into inbuf. */
+    const unsigned char *in;
+    size_t in_len;
+    FILE *fp;
+    unsigned char *inbuf;
+    uint64_t in_offset;  /* input offset of in */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    DecodedBuf bufs[DEC_BUFFERS];
+    size_t head;         /* oldest buffer not yet released by the reader */
+    size_t count;        /* buffers produced and not yet released */
+    int holding;         /* the reader's window is bufs[head] */
+    int done;
+    int error;
+} Decoder;
+
+/*
+ * Byte source for the scanners.  The scanners walk [p, end) with plain
+ * pointers and only call reader_fill() when the window runs dry.  A mapped
+ * file is a single window covering the whole file, so fill() just reports
+ * EOF; streams (pipes, terminals, unmappable files) refill a fixed buffer
+ * with fread(); compressed inputs hand over decoder buffers.
+ */
+typedef struct Reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    const unsigned char *base;  /* start of the current window */
+    uint64_t base_offset;       /* input offset of base */
+    FILE *fp;                   /* NULL when mapped */
+    unsigned char *buf;
+    void *map;
+    size_t map_len;
+    int format;                 /* DEC_* when compressed, else -1 */
+    Decoder *dec;               /* non-NULL once decoding has started */
+    uint64_t in_offset;         /* compressed bytes behind the window */
+    const unsigned char *blk;   /* block described by masks, NULL if none */
+    BlockMasks masks;
+} Reader;
+
+/* Next slice of compressed input, or 0 at its end. */
+static int dec_input(Decoder *d, const unsigned char **p, size_t *n) {
+    if (d->fp && d->in_len == 0) {
+        d->in_len = fread(d->inbuf, 1, READ_BUF_SIZE, d->fp);
+        d->in = d->inbuf;
+    }
+    if (d->in_len == 0) return 0;
+    /* zlib counts in 32-bit units. */
+    *n = d->in_len < ((size_t)1 << 30) ? d->in_len : (size_t)1 << 30;
+    *p = d->in;
+    return 1;
+}
+
+/* Marks n bytes of the slice from dec_input() consumed. */
+static void dec_consume(Decoder *d, size_t n) {
+    d->in += n;
+    d->in_len -= n;
+    d->in_offset += n;
+}
+
+/* Waits for a free output buffer. */
+static unsigned char *dec_acquire(Decoder *d) {
+    pthread_mutex_lock(&d->lock);
+    while (d->count == DEC_BUFFERS) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    unsigned char *out = d->bufs[(d->head + d->count) % DEC_BUFFERS].data;
+    pthread_mutex_unlock(&d->lock);
+    return out;
+}
+
+/* Hands the acquired buffer, holding len bytes, to the reader. */
+static void dec_publish(Decoder *d, size_t len) {
+    if (len == 0) return;
+    pthread_mutex_lock(&d->lock);
+    DecodedBuf *b = &d->bufs[(d->head + d->count) % DEC_BUFFERS];
+    b->len = len;
+    b->in_offset = d->in_offset;
+    d->count++;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+#ifdef HAVE_ZLIB
+/* Inflates gzip members (concatenated members included) and zlib streams. */
+static int dec_run_gzip(Decoder *d) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) return 0;
+
+    int ok = 1;
+    int in_stream = 0;
+    unsigned char *out = dec_acquire(d);
+    size_t out_len = 0;
+    const unsigned char *in;
+    size_t in_n;
+    while (ok && dec_input(d, &in, &in_n)) {
+        zs.next_in = (Bytef *)(uintptr_t)in;
+        zs.avail_in = (uInt)in_n;
+        for (;;) {
+            zs.next_out = out + out_len;
+            zs.avail_out = (uInt)(READ_BUF_SIZE - out_len);
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            out_len = READ_BUF_SIZE - zs.avail_out;
+            if (rc == Z_STREAM_END) {
+                in_stream = 0;
+                inflateReset(&zs);
+            } else if (rc == Z_OK) {
+                in_stream = 1;
+            } else if (rc != Z_BUF_ERROR) {
+                ok = 0;
+                break;
+            }
+            if (out_len == READ_BUF_SIZE) {
+                dec_consume(d, in_n - zs.avail_in);
+                in_n = zs.avail_in;
+                dec_publish(d, out_len);
+                out = dec_acquire(d);
+                out_len = 0;
+                continue;
+            }
+            /* With room left, inflate only stops when the input runs out. */
+            if (zs.avail_in == 0) break;
+            if (rc == Z_BUF_ERROR) {
+                ok = 0;
+                break;
+            }
+        }
+        dec_consume(d, in_n - zs.avail_in);
+    }
+    /* Input that ends inside a member is truncated. */
+    if (in_stream) ok = 0;
+    dec_publish(d, out_len);
+    inflateEnd(&zs);
+    return ok;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Decompresses a sequence of zstd frames. */
+static int dec_run_zstd(Decoder *d) {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!dctx) return 0;
+
+    int ok = 1;
+    size_t pending = 0;  /* nonzero while a frame is incomplete */
+    unsigned char *out = dec_acquire(d);
+    size_t out_len = 0;
+    const unsigned char *in;
+    size_t in_n;
+    while (ok && dec_input(d, &in, &in_n)) {
+        ZSTD_inBuffer ib = {in, in_n, 0};
+        while (ib.pos < ib.size || out_len == READ_BUF_SIZE) {
+            if (out_len == READ_BUF_SIZE) {
+                dec_publish(d, out_len);
+                out = dec_acquire(d);
+                out_len = 0;
+            }
+            ZSTD_outBuffer ob = {out, READ_BUF_SIZE, out_len};
+            pending = ZSTD_decompressStream(dctx, &ob, &ib);
+            out_len = ob.pos;
+            if (ZSTD_isError(pending)) {
+                ok = 0;
+                break;
+            }
+            if (ob.pos < ob.size && ib.pos == ib.size) break;
+        }
+        dec_consume(d, ib.pos);
+    }
+    if (pending != 0) ok = 0;
+    dec_publish(d, out_len);
+    ZSTD_freeDCtx(dctx);
+    return ok;
+}
+#endif
+
+static void *dec_thread(void *arg) {
+    Decoder *d = (Decoder *)arg;
+    int ok = 0;
+#ifdef HAVE_ZLIB
+    if (d->format == DEC_GZIP) ok = dec_run_gzip(d);
+#endif
+#ifdef HAVE_ZSTD
+    if (d->format == DEC_ZSTD) ok = dec_run_zstd(d);
+#endif
+    pthread_mutex_lock(&d->lock);
+    d->error = !ok;
+    d->done = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/* Compression format of data starting with p[0..n), or -1. */
+static int dec_detect(const unsigned char *p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return DEC_GZIP;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return DEC_ZSTD;
+    return -1;
+}
+
+/* Starts decoding in_len bytes at in, followed by the rest of fp if fp is
+ * not NULL (in then being inbuf, a READ_BUF_SIZE buffer the decoder takes
+ * over).  The reader's window becomes empty until the first fill. */
+static void dec_start(Reader *r, int format, const unsigned char *in, size_t in_len, FILE *fp,
+                      unsigned char *inbuf, uint64_t in_offset) {
+#ifndef HAVE_ZLIB
+    if (format == DEC_GZIP) die("gzip input, but built without zlib");
+#endif
+#ifndef HAVE_ZSTD
+    if (format == DEC_ZSTD) die("zstd input, but built without libzstd");
+#endif
+    Decoder *d = (Decoder *)xmalloc(sizeof(Decoder));
+    memset(d, 0, sizeof(*d));
+    d->format = format;
+    d->in = in;
+    d->in_len = in_len;
+    d->fp = fp;
+    d->inbuf = inbuf;
+    d->in_offset = in_offset;
+    for (int i = 0; i < DEC_BUFFERS; ++i) {
+        d->bufs[i].data = (unsigned char *)xmalloc(READ_BUF_SIZE);
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    if (pthread_create(&d->thread, NULL, dec_thread, d) != 0) {
+        die("Cannot create decompression thread");
+    }
+
+    r->dec = d;
+    r->fp = NULL;
+    r->buf = NULL;
+    r->base = r->p = r->end = d->bufs[0].data;
+    r->base_offset = 0;
+    r->in_offset = in_offset;
+}
+
+/* Stops the decoder, which may be blocked on a full ring if the scan ended
+ * early, and reports whether the whole input decoded cleanly. */
+static int dec_finish(Decoder *d) {
+    pthread_mutex_lock(&d->lock);
+    while (!d->done) {
+        /* Release everything so the decoder can run to the end. */
+        d->count = 0;
+        d->holding = 0;
+        pthread_cond_broadcast(&d->cond);
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    int ok = !d->error;
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    for (int i = 0; i < DEC_BUFFERS; ++i) {
+        free(d->bufs[i].data);
+    }
+    free(d->inbuf);
+    free(d);
+    return ok;
+}
+
+/* Moves the reader to the next decoded buffer.  Returns 0 at the end. */
+static int dec_fill(Reader *r) {
+    Decoder *d = r->dec;
+    pthread_mutex_lock(&d->lock);
+    if (d->holding) {
+        d->head = (d->head + 1) % DEC_BUFFERS;
+        d->count--;
+        d->holding = 0;
+        pthread_cond_broadcast(&d->cond);
+    }
+    while (d->count == 0 && !d->done) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    DecodedBuf *b = d->count ? &d->bufs[d->head] : NULL;
+    d->holding = b != NULL;
+    pthread_mutex_unlock(&d->lock);
+
+    r->base_offset += (uint64_t)(r->end - r->base);
+    r->blk = NULL;
+    if (!b) {
+        r->base = r->p = r->end;
+        return 0;
+    }
+    r->base = r->p = b->data;
+    r->end = b->data + b->len;
+    r->in_offset = b->in_offset;
+    return 1;
+}
+
+static void reader_open(Reader *r, FILE *fp) {
+    memset(r, 0, sizeof(*r));
+
+    struct stat st;
+    int fd = fileno(fp);
+    if (g_use_mmap && fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        off_t start = ftello(fp);
+        if (start >= 0 && start <= st.st_size) {
+            size_t len = (size_t)st.st_size;
+            void *m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) {
+                madvise(m, len, MADV_SEQUENTIAL);
+                r->map = m;
+                r->map_len = len;
+                r->base = (const unsigned char *)m;
+                r->p = r->base + start;
+                r->end = r->base + len;
+                r->format = dec_detect(r->p, (size_t)(r->end - r->p));
+                return;
+            }
+        }
+    }
+
+    /* The first block is read up front to look for a compression magic. */
+    off_t start = ftello(fp);
+    r->fp = fp;
+    r->buf = (unsigned char *)xmalloc(READ_BUF_SIZE);
+    r->base_offset = start > 0 ? (uint64_t)start : 0;
+    size_t n = fread(r->buf, 1, READ_BUF_SIZE, fp);
+    r->base = r->p = r->buf;
+    r->end = r->buf + n;
+    r->format = dec_detect(r->buf, n);
+}
+
+/* Starts decompressing when reader_open() found a compressed input; until
+ * then the window shows the raw bytes. */
+static void reader_decode(Reader *r) {
+    if (r->format < 0 || r->dec) return;
+    if (r->fp) {
+        dec_start(r, r->format, r->buf, (size_t)(r->end - r->buf), r->fp, r->buf, r->base_offset);
+    } else {
+        dec_start(r, r->format, r->p, (size_t)(r->end - r->p), NULL, NULL, (uint64_t)(r->p - r->base));
+    }
+}
+
+/* Returns 0 when a compressed input turned out corrupt or truncated. */
+static int reader_close(Reader *r) {
+    int ok = r->dec ? dec_finish(r->dec) : 1;
+    if (r->map) {
+        munmap(r->map, r->map_len);
+    }
+    free(r->buf);
+    return ok;
+}
+
+/* Replaces the window with the next block of the stream.  Returns 0 at EOF. */
+static int reader_fill(Reader *r) {
+    if (r->dec) return dec_fill(r);
+    if (!r->fp) return 0;
+    size_t n = fread(r->buf, 1, READ_BUF_SIZE, r->fp);
+    r->base_offset += (uint64_t)(r->end - r->base);
+    r->base = r->p = r->buf;
+    r->end = r->buf + n;
+    r->blk = NULL;
+    return n > 0;
+}
+
+static int rd_getc_slow(Reader *r) {
+    if (!reader_fill(r)) return EOF;
+    return *r->p++;
+}
+
+static inline int rd_getc(Reader *r) {
+    return r->p < r->end ? *r->p++ : rd_getc_slow(r);
+}
+
+/* Steps back over the byte returned by the last successful rd_getc(). */
+static inline void rd_ungetc(Reader *r) {
+    r->p--;
+}
+
+static uint64_t rd_offset(const Reader *r) {
+    return r->base_offset + (uint64_t)(r->p - r->base);
+}
+
+/* Input bytes consumed, counted in compressed bytes for compressed input. */
+static uint64_t rd_input_offset(const Reader *r) {
+    return r->dec ? r->in_offset : rd_offset(r);
+}
+
+/* Makes r->masks describe a block containing p, classifying a new block at p
+ * when p is outside the cached one.  Returns 0 when fewer than 64 bytes are
+ * left in the window; the byte loops handle that tail. */
+static inline int rd_block(Reader *r, const unsigned char *p) {
+    if (r->blk && p >= r->blk && p < r->blk + 64) return 1;
+    if (r->end - p < 64) return 0;
+    g_classify(p, &r->masks);
+    r->blk = p;
+    return 1;
+}
+
+/* Advances r->p to the next '"' in the window, or to the unclassified tail. */
+static void skip_to_quote(Reader *r) {
+    const unsigned char *p = r->p;
+    while (rd_block(r, p)) {
+        uint64_t m = r->masks.quote & (~0ULL << (p - r->blk));
+        if (m) {
+            r->p = r->blk + __builtin_ctzll(m);
+            return;
+        }
+        p = r->blk + 64;
+    }
+    r->p = p;
+}
+
+/* First '"' or '\\' at or after p in the window, or NULL. */
+static const unsigned char *find_quote_or_backslash(Reader *r, const unsigned char *p) {
+    if (g_classify) {
+        while (rd_block(r, p)) {
+            uint64_t m = (r->masks.quote | r->masks.backslash) & (~0ULL << (p - r->blk));
+            if (m) return r->blk + __builtin_ctzll(m);
+            p = r->blk + 64;
+        }
+    }
+    for (; p < r->end; ++p) {
+        if (*p == '"' || *p == '\\') return p;
+    }
+    return NULL;
+}
+
+static int skip_ws(Reader *r) {
+    int c;
+    do {
+        c = rd_getc(r);
+    } while (c != EOF && isspace((unsigned char)c));
+    return c;
+}
+
+/* Growable buffer for strings that cannot be used in place. */
+typedef struct {
+    char *buf;
+    size_t cap;
+} Scratch;
+
+/* Decodes the rest of a string whose opening quote was just read into
+ * sc->buf, NUL terminated.  Returns the decoded length, or -1 on EOF or a
+ * malformed \u escape. */
+static ptrdiff_t decode_json_string(Reader *r, Scratch *sc) {
+    size_t len = 0;
+    if (!sc->buf) {
+        sc->cap = 32;
+        sc->buf = (char *)xmalloc(sc->cap);
+    }
+
+    for (;;) {
+        int c = rd_getc(r);
+        if (c == EOF) {
+            return -1;
+        }
+        if (c == '"') {
+            sc->buf[len] = '\0';
+            return (ptrdiff_t)len;
+        }
+        if (c == '\\') {
+            int esc = rd_getc(r);
+            if (esc == EOF) {
+                return -1;
+            }
+            if (esc == 'u') {
+                for (int i = 0; i < 4; ++i) {
+                    int h = rd_getc(r);
+                    if (h == EOF || !isxdigit((unsigned char)h)) {
+                        return -1;
+                    }
+                }
+                c = '?';
+            } else {
+                switch (esc) {
+                    case '"': c = '"'; break;
+                    case '\\': c = '\\'; break;
+                    case '/': c = '/'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    default: c = esc; break;
+                }
+            }
+        }
+
+        if (len + 1 >= sc->cap) {
+            char *tmp = (char *)realloc(sc->buf, sc->cap * 2);
+            if (!tmp) {
+                die("Out of memory");
+            }
+            sc->buf = tmp;
+            sc->cap *= 2;
+        }
+        sc->buf[len++] = (char)c;
+    }
+}
+
+static char *read_json_string(Reader *r) {
+    /* Common case: the closing quote is in the window and nothing is escaped. */
+    const unsigned char *q = find_quote_or_backslash(r, r->p);
+    if (q && *q == '"') {
+        size_t n = (size_t)(q - r->p);
+        char *s = (char *)xmalloc(n + 1);
+        memcpy(s, r->p, n);
+        s[n] = '\0';
+        r->p = q + 1;
+        return s;
+    }
+
+    Scratch sc = {NULL, 0};
+    if (decode_json_string(r, &sc) < 0) {
+        free(sc.buf);
+        return NULL;
+    }
+    return sc.buf;
+}
+
+/* A located string value.  ptr is not NUL terminated. */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} ValueRef;
+
+/*
+ * Reads the string value whose opening quote was just read.  An unescaped
+ * value inside the window is used in place; anything else is decoded into
+ * sc.  Callers hash the bytes right away, while they are still in L1.
+ * Returns 0 on EOF.
+ */
+static int read_value(Reader *r, Scratch *sc, ValueRef *v) {
+    const unsigned char *q = find_quote_or_backslash(r, r->p);
+    if (q && *q == '"') {
+        v->ptr = (const char *)r->p;
+        v->len = (size_t)(q - r->p);
+        r->p = q + 1;
+    } else {
+        ptrdiff_t n = decode_json_string(r, sc);
+        if (n < 0) return 0;
+        v->ptr = sc->buf;
+        v->len = (size_t)n;
+    }
+    return 1;
+}
+
+/*
+ * Skips the rest of an object or array whose opening bracket was just read.
+ * Escapes and string state are carried between blocks as in the scalar loop;
+ * a block whose closing brackets cannot bring the depth to zero is accounted
+ * with two popcounts, otherwise its brackets are walked bit by bit.
+ */
+static int skip_nested_simd(Reader *r) {
+    int64_t depth = 1;
+    uint64_t in_string = 0;  /* all ones inside a string */
+    uint64_t esc = 0;
+
+    for (;;) {
+        const unsigned char *p = r->p;
+        while (rd_block(r, p)) {
+            const unsigned char *b = r->blk;
+            uint64_t valid = ~0ULL << (p - b);
+            uint64_t escaped = find_escaped(r->masks.backslash & valid, &esc);
+            uint64_t quotes = r->masks.quote & valid & ~escaped;
+            uint64_t str = prefix_xor(quotes) ^ in_string;
+            in_string = (uint64_t)0 - (str >> 63);
+            uint64_t opens = r->masks.open & valid & ~str;
+            uint64_t closes = r->masks.close & valid & ~str;
+
+            int64_t nclose = __builtin_popcountll(closes);
+            if (nclose < depth) {
+                depth += __builtin_popcountll(opens) - nclose;
+            } else {
+                for (uint64_t s = opens | closes; s; s &= s - 1) {
+                    uint64_t bit = s & (0 - s);
+                    depth += (opens & bit) ? 1 : -1;
+                    if (depth == 0) {
+                        r->p = b + __builtin_ctzll(s) + 1;
+                        return 1;
+                    }
+                }
+            }
+            p = b + 64;
+        }
+
+        /* Fewer than 64 bytes left in the window. */
+        int str = in_string != 0;
+        int e = esc != 0;
+        for (; p < r->end; ++p) {
+            unsigned char c = *p;
+            if (str) {
+                if (e) {
+                    e = 0;
+                } else if (c == '\\') {
+                    e = 1;
+                } else if (c == '"') {
+                    str = 0;
+                }
+                continue;
+            }
+            if (c == '"') {
+                str = 1;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (--depth == 0) {
+                    r->p = p + 1;
+                    return 1;
+                }
+            }
+        }
+        r->p = p;
+        if (!reader_fill(r)) return 0;
+        in_string = (uint64_t)0 - (uint64_t)str;
+        esc = (uint64_t)e;
+    }
+}
+
+static int consume_json_value(Reader *r, int first) {
+    int c = first;
+
+    if (c == '"') {
+        char *s = read_json_string(r);
+        if (!s) return 0;
+        free(s);
+        return 1;
+    }
+
+    if (c == '{' || c == '[') {
+        if (g_classify) return skip_nested_simd(r);
+        int depth = 1;
+        int in_string = 0;
+        int esc = 0;
+        while (depth > 0) {
+            c = rd_getc(r);
+            if (c == EOF) return 0;
+
+            if (in_string) {
+                if (esc) {
+                    esc = 0;
+                } else if (c == '\\') {
+                    esc = 1;
+                } else if (c == '"') {
+                    in_string = 0;
+                }
+                continue;
+            }
+
+            if (c == '"') {
+                in_string = 1;
+            } else if (c == '{' || c == '[') {
+                depth++;
+            } else if (c == '}' || c == ']') {
+                depth--;
+            }
+        }
+        return 1;
+    }
+
+    while (c != EOF && c != ',' && c != '}' && c != ']' && !isspace((unsigned char)c)) {
+        c = rd_getc(r);
+    }
+    if (c == ',' || c == '}' || c == ']') {
+        rd_ungetc(r);
+    }
+    return 1;
+}
+
+/*
+ * Checkpoints.  With --checkpoint=FILE the scan state is written to FILE
+ * every --checkpoint-interval seconds or --checkpoint-bytes of input, and
+ * --resume starts from it.  A serial scan records the offset of the key it
+ * is about to read; the scanner carries no state from one key to the next,
+ * so restarting there is exact.  A parallel scan records which chunks are
+ * finished: at chunk boundaries workers fold their tables into a shared
+ * checkpoint table, which therefore always holds exactly the counts of the
+ * finished chunks.  Files are written beside FILE, synced and renamed over
+ * it.  The reporter thread decides when a checkpoint is due, so scanners
+ * only compare an epoch counter.
+ */
+#define CKPT_MAGIC "MCCKPT02"
+#define CKPT_END "MCCKPEND"
+
+enum { CKPT_SERIAL, CKPT_CHUNKS };
+
+typedef struct {
+    const char *path;
+    double interval;         /* seconds between checkpoints, 0 for none */
+    uint64_t every_bytes;    /* input bytes between checkpoints, 0 for none */
+    uint64_t input_size;     /* identity of the input */
+    int64_t input_mtime;     /* nanoseconds */
+    atomic_uint epoch;       /* bumped whenever a checkpoint is due */
+    double due_time;         /* reporter's bookkeeping */
+    uint64_t due_bytes;
+
+    /* Scan position, as restored by checkpoint_load() and kept since. */
+    int loaded;
+    int kind;
+    uint64_t offset;         /* CKPT_SERIAL: next key */
+    uint64_t chunk_size;     /* CKPT_CHUNKS: geometry, 0 for zstd frames */
+    size_t chunk_count;
+    unsigned char *done;     /* CKPT_CHUNKS: one byte per chunk */
+
+    /* Counts of the finished chunks, or the loaded counts until a serial
+     * scan takes them over. */
+    pthread_mutex_t lock;
+    HashTable table;
+    uint64_t models_seen;
+    int active;              /* parallel workers still running */
+    int folded;              /* folds since the last write */
+} Checkpoint;
+
+static Checkpoint *g_checkpoint = NULL;
+
+static int checkpoint_init(Checkpoint *ck, const char *path, const char *input) {
+    struct stat st;
+    if (stat(input, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    memset(ck, 0, sizeof(*ck));
+    ck->path = path;
+    ck->input_size = (uint64_t)st.st_size;
+    ck->input_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    atomic_init(&ck->epoch, 0);
+    pthread_mutex_init(&ck->lock, NULL);
+    table_init(&ck->table, INITIAL_BUCKETS);
+    return 1;
+}
+
+static void checkpoint_free(Checkpoint *ck) {
+    table_free(&ck->table);
+    pthread_mutex_destroy(&ck->lock);
+    free(ck->done);
+}
+
+static void put_u64(FILE *fp, uint64_t v) {
+    fwrite(&v, sizeof(v), 1, fp);
+}
+
+static int get_u64(FILE *fp, uint64_t *v) {
+    return fread(v, sizeof(*v), 1, fp) == 1;
+}
+
+/* The --key path counts were taken at, which saved state must match. */
+static const char *key_path_source(void);
+
+static void put_key_path(FILE *fp) {
+    const char *key = key_path_source();
+    put_u64(fp, strlen(key));
+    fwrite(key, 1, strlen(key), fp);
+}
+
+static int key_path_matches(FILE *fp) {
+    const char *key = key_path_source();
+    uint64_t len;
+    if (!get_u64(fp, &len) || len != strlen(key)) return 0;
+    char *buf = (char *)xmalloc((size_t)len + 1);
+    int ok = fread(buf, 1, (size_t)len, fp) == len && memcmp(buf, key, (size_t)len) == 0;
+    free(buf);
+    return ok;
+}
+
+static void save_entry(const EntryView *e, void *ctx) {
+    FILE *fp = (FILE *)ctx;
+    put_u64(fp, e->count);
+    put_u64(fp, e->len);
+    fwrite(e->key, 1, e->len, fp);
+}
+
+/* Writes the table as its size followed by (count, length, key bytes). */
+static void table_save(FILE *fp, const HashTable *t) {
+    put_u64(fp, t->size);
+    table_foreach(t, save_entry, fp);
+}
+
+/* Adds the counts written by table_save() to t. */
+static int table_load(FILE *fp, HashTable *t) {
+    uint64_t n;
+    if (!get_u64(fp, &n)) return 0;
+    Scratch sc = {NULL, 0};
+    int ok = 1;
+    for (uint64_t i = 0; i < n && ok; ++i) {
+        uint64_t count, len;
+        ok = get_u64(fp, &count) && get_u64(fp, &len) && len < ((uint64_t)1 << 32);
+        if (!ok) break;
+        if (len + 1 > sc.cap) {
+            free(sc.buf);
+            sc.cap = (size_t)len + 1;
+            sc.buf = (char *)xmalloc(sc.cap);
+        }
+        ok = fread(sc.buf, 1, (size_t)len, fp) == len;
+        if (ok) table_add(t, sc.buf, (size_t)len, hash_bytes(sc.buf, (size_t)len), count);
+    }
+    free(sc.buf);
+    return ok;
+}
+
+/* Writes the checkpoint with the given counts.  Failures are reported but
+ * do not stop the scan. */
+static void checkpoint_write(Checkpoint *ck, const HashTable *table, uint64_t models_seen) {
+    size_t n = strlen(ck->path) + 5;
+    char *tmp = (char *)xmalloc(n);
+    snprintf(tmp, n, "%s.tmp", ck->path);
+
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) {
+        fwrite(CKPT_MAGIC, 1, 8, fp);
+        put_u64(fp, ck->input_size);
+        put_u64(fp, (uint64_t)ck->input_mtime);
+        put_key_path(fp);
+        put_u64(fp, (uint64_t)ck->kind);
+        put_u64(fp, models_seen);
+        if (ck->kind == CKPT_SERIAL) {
+            put_u64(fp, ck->offset);
+        } else {
+            put_u64(fp, ck->chunk_size);
+            put_u64(fp, ck->chunk_count);
+            fwrite(ck->done, 1, ck->chunk_count, fp);
+        }
+        table_save(fp, table);
+        fwrite(CKPT_END, 1, 8, fp);
+        ok = fflush(fp) == 0 && !ferror(fp) && fsync(fileno(fp)) == 0;
+        ok &= fclose(fp) == 0;
+    }
+    if (ok) ok = rename(tmp, ck->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "\nCannot write checkpoint '%s': %s\n", ck->path, strerror(errno));
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+/* Restores a checkpoint written for the same input.  Returns 1 when loaded,
+ * 0 when there is none, -1 when it is unusable. */
+static int checkpoint_load(Checkpoint *ck) {
+    FILE *fp = fopen(ck->path, "rb");
+    if (!fp) return errno == ENOENT ? 0 : -1;
+
+    char magic[8];
+    uint64_t size, mtime, kind;
+    int ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, CKPT_MAGIC, 8) == 0 &&
+             get_u64(fp, &size) && get_u64(fp, &mtime);
+    if (ok && (size != ck->input_size || (int64_t)mtime != ck->input_mtime)) {
+        fprintf(stderr, "Checkpoint '%s' was written for a different input\n", ck->path);
+        ok = 0;
+    } else if (ok && !key_path_matches(fp)) {
+        fprintf(stderr, "Checkpoint '%s' was written for a different --key\n", ck->path);
+        ok = 0;
+    }
+    ok = ok && get_u64(fp, &kind) && get_u64(fp, &ck->models_seen);
+    if (ok && kind == CKPT_SERIAL) {
+        ok = get_u64(fp, &ck->offset);
+    } else if (ok && kind == CKPT_CHUNKS) {
+        uint64_t count;
+        ok = get_u64(fp, &ck->chunk_size) && get_u64(fp, &count) && count <= size + 1;
+        if (ok) {
+            ck->chunk_count = (size_t)count;
+            ck->done = (unsigned char *)xmalloc(ck->chunk_count + 1);
+            ok = fread(ck->done, 1, ck->chunk_count, fp) == ck->chunk_count;
+        }
+    } else {
+        ok = 0;
+    }
+    ok = ok && table_load(fp, &ck->table) && fread(magic, 1, 8, fp) == 8 && memcmp(magic, CKPT_END, 8) == 0;
+    fclose(fp);
+    if (!ok) return -1;
+    ck->kind = (int)kind;
+    ck->loaded = 1;
+    return 1;
+}
+
+/* Seconds between reporter wakeups while --checkpoint-bytes is watched. */
+#define CKPT_BYTES_POLL_SEC 0.25
+
+/* Starts the checkpoint clock; the reporter calls it as the scan starts. */
+static void checkpoint_arm(Checkpoint *ck, double now) {
+    ck->due_time = now;
+    ck->due_bytes = 0;
+}
+
+/* When the reporter has to call checkpoint_tick() next, at the latest. */
+static double checkpoint_next(const Checkpoint *ck, double now) {
+    double next = ck->interval > 0.0 ? ck->due_time + ck->interval : HUGE_VAL;
+    if (ck->every_bytes > 0 && now + CKPT_BYTES_POLL_SEC < next) next = now + CKPT_BYTES_POLL_SEC;
+    return next;
+}
+
+/* Called by the reporter thread with the bytes consumed so far. */
+static void checkpoint_tick(Checkpoint *ck, double now, uint64_t bytes) {
+    if ((ck->interval > 0.0 && now - ck->due_time >= ck->interval) ||
+        (ck->every_bytes > 0 && bytes - ck->due_bytes >= ck->every_bytes)) {
+        atomic_fetch_add_explicit(&ck->epoch, 1, memory_order_relaxed);
+        ck->due_time = now;
+        ck->due_bytes = bytes;
+    }
+}
+
+/* Advances the reader to input offset `to`.  Returns 0 if the input ends
+ * first. */
+static int rd_seek(Reader *r, uint64_t to) {
+    while (r->base_offset + (uint64_t)(r->end - r->base) < to) {
+        if (!reader_fill(r)) return 0;
+    }
+    if (to < rd_offset(r)) return 0;
+    r->p = r->base + (to - r->base_offset);
+    r->blk = NULL;
+    return 1;
+}
+
+/* Prepares a serial scan: takes over loaded counts and moves the reader to
+ * the saved offset. */
+static int checkpoint_begin_serial(Checkpoint *ck, Reader *r, HashTable *table, uint64_t *models_seen) {
+    if (ck->loaded) {
+        if (ck->kind != CKPT_SERIAL) {
+            fprintf(stderr, "Checkpoint '%s' is from a parallel scan; resume with the same -j\n", ck->path);
+            return 0;
+        }
+        if (!rd_seek(r, ck->offset)) return 0;
+    }
+    table_merge(table, &ck->table);
+    *models_seen += ck->models_seen;
+    table_free(&ck->table);
+    table_init(&ck->table, 16);
+    ck->models_seen = 0;
+    ck->kind = CKPT_SERIAL;
+    return 1;
+}
+
+/*
+ * Sidecar cache.  With --sidecar the first run over an input saves, beside
+ * it, the dictionary of distinct model values and the model of every record
+ * as a bit-packed dictionary ID, in record order.  Later runs over the same
+ * input (same size and mtime) rebuild the counts from the IDs without
+ * parsing any JSON; a sidecar that does not match is rebuilt.
+ */
+#define SIDE_MAGIC "MCSIDE02"
+#define SIDE_END "MCSIDEND"
+#define SIDE_SUFFIX ".mcidx"
+
+/* Model values in record order, as IDs into the log's own dictionary. */
+typedef struct {
+    HashTable ids;  /* value -> ID + 1 */
+    uint32_t *seq;
+    size_t len;
+    size_t cap;
+} SeqLog;
+
+static void seqlog_init(SeqLog *l) {
+    table_init(&l->ids, INITIAL_BUCKETS);
+    l->seq = NULL;
+    l->len = 0;
+    l->cap = 0;
+}
+
+static void seqlog_free(SeqLog *l) {
+    table_free(&l->ids);
+    free(l->seq);
+}
+
+/* ID of key in l's dictionary, added when new. */
+static uint32_t seqlog_id(SeqLog *l, const char *key, size_t len) {
+    uint64_t *id = table_count(&l->ids, key, len, hash_bytes(key, len));
+    if (*id == 0) {
+        if (l->ids.size > UINT32_MAX) die("Too many distinct models for a sidecar");
+        *id = l->ids.size;
+    }
+    return (uint32_t)(*id - 1);
+}
+
+static void seqlog_push(SeqLog *l, uint32_t id) {
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4096;
+        l->seq = (uint32_t *)realloc(l->seq, l->cap * sizeof(uint32_t));
+        if (!l->seq) die("Out of memory");
+    }
+    l->seq[l->len++] = id;
+}
+
+typedef struct {
+    SeqLog *dst;
+    uint32_t *map;
+} RemapCtx;
+
+static void remap_entry(const EntryView *e, void *ctx) {
+    RemapCtx *c = (RemapCtx *)ctx;
+    c->map[e->count - 1] = seqlog_id(c->dst, e->key, e->len);
+}
+
+/* Array translating src's IDs into dst's, adding values dst lacks. */
+static uint32_t *seqlog_remap(SeqLog *dst, const SeqLog *src) {
+    RemapCtx c = {dst, (uint32_t *)xmalloc((src->ids.size ? src->ids.size : 1) * sizeof(uint32_t))};
+    table_foreach(&src->ids, remap_entry, &c);
+    return c.map;
+}
+
+typedef struct {
+    char *path;
+    uint64_t input_size;
+    int64_t input_mtime;  /* nanoseconds */
+    SeqLog log;           /* filled by the scan that builds the sidecar */
+} Sidecar;
+
+static Sidecar *g_sidecar = NULL;
+
+/* path NULL means the input's name plus SIDE_SUFFIX. */
+static int sidecar_init(Sidecar *sc, const char *path, const char *input) {
+    struct stat st;
+    if (stat(input, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    size_t n = (path ? strlen(path) : strlen(input) + strlen(SIDE_SUFFIX)) + 1;
+    sc->path = (char *)xmalloc(n);
+    snprintf(sc->path, n, "%s%s", path ? path : input, path ? "" : SIDE_SUFFIX);
+    sc->input_size = (uint64_t)st.st_size;
+    sc->input_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    seqlog_init(&sc->log);
+    return 1;
+}
+
+static void sidecar_free(Sidecar *sc) {
+    seqlog_free(&sc->log);
+    free(sc->path);
+}
+
+/* Bits per ID for a dictionary of n values. */
+static unsigned id_bits(uint64_t n) {
+    unsigned bits = 1;
+    while (bits < 32 && ((uint64_t)1 << bits) < n) bits++;
+    return bits;
+}
+
+typedef struct {
+    const char **keys;
+    size_t *lens;
+} DictCtx;
+
+static void dict_entry(const EntryView *e, void *ctx) {
+    DictCtx *c = (DictCtx *)ctx;
+    c->keys[e->count - 1] = e->key;
+    c->lens[e->count - 1] = e->len;
+}
+
+/* Writes sc->log as: header, dictionary in ID order (length, bytes), record
+ * count, bits per ID, packed IDs.  Failures are reported; the counts are
+ * still printed. */
+static void sidecar_write(const Sidecar *sc) {
+    const SeqLog *l = &sc->log;
+    size_t nkeys = l->ids.size;
+    DictCtx dict = {(const char **)xmalloc((nkeys ? nkeys : 1) * sizeof(char *)),
+                    (size_t *)xmalloc((nkeys ? nkeys : 1) * sizeof(size_t))};
+    table_foreach(&l->ids, dict_entry, &dict);
+
+    unsigned bits = id_bits(nkeys);
+    size_t words = (size_t)(((uint64_t)l->len * bits + 63) / 64);
+    uint64_t *packed = (uint64_t *)calloc(words ? words : 1, sizeof(uint64_t));
+    if (!packed) die("Out of memory");
+    for (size_t i = 0; i < l->len; ++i) {
+        uint64_t pos = (uint64_t)i * bits;
+        size_t w = (size_t)(pos / 64);
+        unsigned off = (unsigned)(pos % 64);
+        packed[w] |= (uint64_t)l->seq[i] << off;
+        if (off + bits > 64) packed[w + 1] |= (uint64_t)l->seq[i] >> (64 - off);
+    }
+
+    size_t n = strlen(sc->path) + 5;
+    char *tmp = (char *)xmalloc(n);
+    snprintf(tmp, n, "%s.tmp", sc->path);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) {
+        fwrite(SIDE_MAGIC, 1, 8, fp);
+        put_u64(fp, sc->input_size);
+        put_u64(fp, (uint64_t)sc->input_mtime);
+        put_key_path(fp);
+        put_u64(fp, nkeys);
+        for (size_t i = 0; i < nkeys; ++i) {
+            put_u64(fp, dict.lens[i]);
+            fwrite(dict.keys[i], 1, dict.lens[i], fp);
+        }
+        put_u64(fp, l->len);
+        put_u64(fp, bits);
+        fwrite(packed, sizeof(uint64_t), words, fp);
+        fwrite(SIDE_END, 1, 8, fp);
+        ok = fflush(fp) == 0 && !ferror(fp);
+        ok &= fclose(fp) == 0;
+    }
+    if (ok) ok = rename(tmp, sc->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Cannot write sidecar '%s': %s\n", sc->path, strerror(errno));
+        remove(tmp);
+    }
+    free(tmp);
+    free(packed);
+    free(dict.keys);
+    free(dict.lens);
+}
+
+/* Counts the records of a matching sidecar into table.  Returns 0 when there
+ * is no usable sidecar, which the caller then builds. */
+static int sidecar_load(const Sidecar *sc, HashTable *table, uint64_t *models_seen) {
+    FILE *fp = fopen(sc->path, "rb");
+    if (!fp) return 0;
+
+    char magic[8];
+    uint64_t size, mtime, nkeys;
+    int ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, SIDE_MAGIC, 8) == 0 && get_u64(fp, &size) &&
+             get_u64(fp, &mtime);
+    if (ok && (size != sc->input_size || (int64_t)mtime != sc->input_mtime || !key_path_matches(fp))) {
+        fprintf(stderr, "Sidecar '%s' is out of date; rebuilding it\n", sc->path);
+        fclose(fp);
+        return 0;
+    }
+    ok = ok && get_u64(fp, &nkeys) && nkeys <= (uint64_t)UINT32_MAX + 1;
+
+    /* Keys are read into one buffer and only hashed once counted. */
+    char **keys = NULL;
+    size_t *lens = NULL;
+    uint64_t *counts = NULL;
+    if (ok) {
+        keys = (char **)calloc(nkeys ? nkeys : 1, sizeof(char *));
+        lens = (size_t *)xmalloc((nkeys ? nkeys : 1) * sizeof(size_t));
+        counts = (uint64_t *)calloc(nkeys ? nkeys : 1, sizeof(uint64_t));
+        if (!keys || !counts) die("Out of memory");
+    }
+    for (uint64_t i = 0; ok && i < nkeys; ++i) {
+        uint64_t len;
+        ok = get_u64(fp, &len) && len < ((uint64_t)1 << 32);
+        if (!ok) break;
+        keys[i] = (char *)xmalloc((size_t)len + 1);
+        lens[i] = (size_t)len;
+        ok = fread(keys[i], 1, (size_t)len, fp) == len;
+    }
+
+    uint64_t records = 0, bits = 0;
+    ok = ok && get_u64(fp, &records) && get_u64(fp, &bits) && bits == id_bits(nkeys) &&
+         records <= (sc->input_size + 1) / 2;
+    if (ok) {
+        size_t words = (size_t)((records * bits + 63) / 64);
+        uint64_t *packed = (uint64_t *)xmalloc((words + 1) * sizeof(uint64_t));
+        ok = fread(packed, sizeof(uint64_t), words, fp) == words && fread(magic, 1, 8, fp) == 8 &&
+             memcmp(magic, SIDE_END, 8) == 0;
+        packed[words] = 0;
+        uint64_t mask = ((uint64_t)1 << bits) - 1;
+        for (uint64_t i = 0; ok && i < records; ++i) {
+            uint64_t pos = i * bits;
+            unsigned off = (unsigned)(pos % 64);
+            uint64_t v = packed[pos / 64] >> off;
+            if (off + bits > 64) v |= packed[pos / 64 + 1] << (64 - off);
+            v &= mask;
+            if (v >= nkeys) ok = 0;
+            else counts[v]++;
+        }
+        free(packed);
+    }
+    fclose(fp);
+
+    if (ok) {
+        for (uint64_t i = 0; i < nkeys; ++i) {
+            if (counts[i]) table_add(table, keys[i], lens[i], hash_bytes(keys[i], lens[i]), counts[i]);
+        }
+        *models_seen += records;
+    } else {
+        fprintf(stderr, "Sidecar '%s' is unreadable; rebuilding it\n", sc->path);
+    }
+    for (uint64_t i = 0; keys && i < nkeys; ++i) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(lens);
+    free(counts);
+    return ok;
+}
+
+/*
+ * Record-boundary index.  A parallel scan of a JSON array spends a summary
+ * pass and a serial hand-off between chunks only to learn where records
+ * start.  With --index, a parallel scan also saves the first record boundary
+ * at or after every stride-th byte beside the input.  Later parallel runs
+ * over the same input cut chunks at multiples of the stride and read their
+ * boundaries from the index, skipping both.
+ */
+#define INDEX_MAGIC "MCOFFS01"
+#define INDEX_END "MCOFFEND"
+#define INDEX_SUFFIX ".mcoff"
+#define INDEX_STRIDE_DEFAULT ((size_t)1 << 20)
+
+typedef struct {
+    char *path;
+    uint64_t input_size;
+    int64_t input_mtime;  /* nanoseconds */
+    uint64_t stride;
+    size_t count;         /* strides in the input */
+    uint64_t *offsets;    /* boundary at or after i * stride, or input_size */
+    int loaded;           /* offsets came from the file */
+    int built;            /* offsets were filled in by a scan */
+} OffsetIndex;
+
+static OffsetIndex *g_index = NULL;
+
+/* path NULL means the input's name plus INDEX_SUFFIX. */
+static int index_init(OffsetIndex *ix, const char *path, const char *input, uint64_t stride) {
+    struct stat st;
+    if (stat(input, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+    memset(ix, 0, sizeof(*ix));
+    size_t n = (path ? strlen(path) : strlen(input) + strlen(INDEX_SUFFIX)) + 1;
+    ix->path = (char *)xmalloc(n);
+    snprintf(ix->path, n, "%s%s", path ? path : input, path ? "" : INDEX_SUFFIX);
+    ix->input_size = (uint64_t)st.st_size;
+    ix->input_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    ix->stride = stride;
+    ix->count = (size_t)((ix->input_size + stride - 1) / stride);
+    ix->offsets = (uint64_t *)xmalloc((ix->count + 1) * sizeof(uint64_t));
+    return 1;
+}
+
+static void index_free(OffsetIndex *ix) {
+    free(ix->offsets);
+    free(ix->path);
+}
+
+static void index_write(const OffsetIndex *ix) {
+    size_t n = strlen(ix->path) + 5;
+    char *tmp = (char *)xmalloc(n);
+    snprintf(tmp, n, "%s.tmp", ix->path);
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp != NULL;
+    if (ok) {
+        fwrite(INDEX_MAGIC, 1, 8, fp);
+        put_u64(fp, ix->input_size);
+        put_u64(fp, (uint64_t)ix->input_mtime);
+        put_u64(fp, ix->stride);
+        put_u64(fp, ix->count);
+        fwrite(ix->offsets, sizeof(uint64_t), ix->count, fp);
+        fwrite(INDEX_END, 1, 8, fp);
+        ok = fflush(fp) == 0 && !ferror(fp);
+        ok &= fclose(fp) == 0;
+    }
+    if (ok) ok = rename(tmp, ix->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Cannot write index '%s': %s\n", ix->path, strerror(errno));
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+/* Loads a matching index, whose stride replaces the requested one.  Returns
+ * 0 when there is none; the next parallel scan builds it. */
+static int index_load(OffsetIndex *ix) {
+    FILE *fp = fopen(ix->path, "rb");
+    if (!fp) return 0;
+    char magic[8];
+    uint64_t size, mtime, stride, count;
+    int ok = fread(magic, 1, 8, fp) == 8 && memcmp(magic, INDEX_MAGIC, 8) == 0 && get_u64(fp, &size) &&
+             get_u64(fp, &mtime) && get_u64(fp, &stride) && get_u64(fp, &count);
+    if (ok && (size != ix->input_size || (int64_t)mtime != ix->input_mtime)) {
+        fprintf(stderr, "Index '%s' is out of date; rebuilding it\n", ix->path);
+        fclose(fp);
+        return 0;
+    }
+    ok = ok && stride > 0 && count == (size + stride - 1) / stride;
+    uint64_t *offsets = NULL;
+    if (ok) {
+        offsets = (uint64_t *)xmalloc(((size_t)count + 1) * sizeof(uint64_t));
+        ok = fread(offsets, sizeof(uint64_t), (size_t)count, fp) == count && fread(magic, 1, 8, fp) == 8 &&
+             memcmp(magic, INDEX_END, 8) == 0;
+        for (uint64_t i = 0; ok && i < count; ++i) {
+            ok = offsets[i] >= i * stride && offsets[i] <= size;
+        }
+    }
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "Index '%s' is unreadable; rebuilding it\n", ix->path);
+        free(offsets);
+        return 0;
+    }
+    free(ix->offsets);
+    ix->offsets = offsets;
+    ix->stride = stride;
+    ix->count = (size_t)count;
+    ix->loaded = 1;
+    return 1;
+}
+
+/*
+ * Progress reporting.  Scanners publish running totals into relaxed atomics
+ * every PROGRESS_TICK keys; a reporter thread samples them every
+ * PROGRESS_INTERVAL_SEC and prints the status line, so the scan loop never
+ * reads the clock or makes a system call for progress.  With --checkpoint
+ * the reporter also wakes whenever a checkpoint may be due.
+ */
+#define PROGRESS_TICK 4096
+
+typedef struct {
+    long total_bytes;
+    atomic_uint_fast64_t bytes;   /* input consumed */
+    atomic_uint_fast64_t models;
+    atomic_size_t unique;         /* lower bound while workers run */
+    atomic_size_t arena_reserved;
+    atomic_size_t arena_used;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int stop;
+    int printed;
+} Progress;
+
+static double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static void progress_init(Progress *p, long total_bytes) {
+    memset(p, 0, sizeof(*p));
+    p->total_bytes = total_bytes;
+    atomic_init(&p->bytes, 0);
+    atomic_init(&p->models, 0);
+    atomic_init(&p->unique, 0);
+    atomic_init(&p->arena_reserved, 0);
+    atomic_init(&p->arena_used, 0);
+}
+
+/* What one scanner has added to the shared totals so far.  Any number of
+ * scanners, on any number of inputs, publish into one Progress. */
+typedef struct {
+    uint64_t bytes;
+    uint64_t models;
+    ArenaStats arena;
+} ProgressMark;
+
+static void progress_mark(ProgressMark *m, uint64_t bytes, uint64_t models, const HashTable *t) {
+    m->bytes = bytes;
+    m->models = models;
+    m->arena = t->arena.stats;
+}
+
+/* Adds a scanner's progress since its mark.  Scanners count into private
+ * tables, so the largest of them is the best lower bound on the global
+ * unique count until the merge. */
+static void progress_advance(Progress *p, ProgressMark *m, uint64_t bytes, uint64_t models, const HashTable *t) {
+    atomic_fetch_add_explicit(&p->bytes, bytes - m->bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->models, models - m->models, memory_order_relaxed);
+    size_t unique = t->size;
+    size_t prev = atomic_load_explicit(&p->unique, memory_order_relaxed);
+    while (unique > prev && !atomic_compare_exchange_weak_explicit(&p->unique, &prev, unique,
+                                                                   memory_order_relaxed, memory_order_relaxed)) {
+    }
+    const ArenaStats *now = &t->arena.stats;
+    atomic_fetch_add_explicit(&p->arena_reserved, now->reserved - m->arena.reserved, memory_order_relaxed);
+    atomic_fetch_add_explicit(&p->arena_used, now->used - m->arena.used, memory_order_relaxed);
+    progress_mark(m, bytes, models, t);
+}
+
+static void print_progress(Progress *p, double elapsed, uint64_t interval_models) {
+    uint64_t pos = atomic_load_explicit(&p->bytes, memory_order_relaxed);
+    uint64_t models_seen = atomic_load_explicit(&p->models, memory_order_relaxed);
+    double pct = 0.0;
+    if (p->total_bytes > 0) {
+        pct = 100.0 * (double)pos / (double)p->total_bytes;
+        if (pct > 100.0) pct = 100.0;
+    }
+
+    FILE *mem = fopen("/proc/self/statm", "r");
+    if (!mem) {
+        return;
+    }
+
+    unsigned long size_pages = 0;
+    unsigned long rss_pages = 0;
+    if (fscanf(mem, "%lu %lu", &size_pages, &rss_pages) == 2) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        if (page_size > 0) {
+            double interval_speed = elapsed > 0.0 ? (double)interval_models / elapsed : 0.0;
+            double rss_mb = (double)rss_pages * (double)page_size / (1024.0 * 1024.0);
+            size_t used = atomic_load_explicit(&p->arena_used, memory_order_relaxed);
+            size_t reserved = atomic_load_explicit(&p->arena_reserved, memory_order_relaxed);
+            fprintf(stderr,
+                    "\r%.2f%% processed, %llu models, unique %zu, RSS %.2f MB, "
+                    "arena %.2f/%.2f MB, speed %.0f models/s",
+                    pct, (unsigned long long)models_seen, atomic_load_explicit(&p->unique, memory_order_relaxed),
+                    rss_mb, (double)used / (1024.0 * 1024.0), (double)reserved / (1024.0 * 1024.0),
+                    interval_speed);
+            fflush(stderr);
+            p->printed = 1;
+        }
+    }
+
+    fclose(mem);
+}
+
+static void *progress_thread(void *arg) {
+    Progress *p = (Progress *)arg;
+    double last_time = now_seconds();
+    uint64_t last_models = 0;
+    if (g_checkpoint) checkpoint_arm(g_checkpoint, last_time);
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        double wake = last_time + PROGRESS_INTERVAL_SEC;
+        if (g_checkpoint) {
+            double next = checkpoint_next(g_checkpoint, now_seconds());
+            if (next < wake) wake = next;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)wake;
+        ts.tv_nsec = (long)((wake - (double)ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+        if (p->stop) break;
+
+        double t = now_seconds();
+        if (g_checkpoint) checkpoint_tick(g_checkpoint, t, atomic_load_explicit(&p->bytes, memory_order_relaxed));
+        if (t - last_time < PROGRESS_INTERVAL_SEC) continue;
+        uint64_t models = atomic_load_explicit(&p->models, memory_order_relaxed);
+        print_progress(p, t - last_time, models - last_models);
+        last_time = t;
+        last_models = models;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void progress_start(Progress *p) {
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, progress_thread, p) != 0) {
+        die("Cannot create progress thread");
+    }
+    p->running = 1;
+}
+
+/* Stops the reporter and ends its status line. */
+static void progress_stop(Progress *p) {
+    if (!p->running) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    p->running = 0;
+    if (p->printed) {
+        fputc('\n', stderr);
+    }
+}
+
+/*
+ * A key compiled for matching against raw input bytes.  Keys that fit in a
+ * word together with their closing quote are matched with one masked 8-byte
+ * compare; the quote makes a prefix of a longer key fail the compare.
+ */
+typedef struct {
+    const char *text;
+    size_t len;
+    uint64_t word;  /* text and '"', zero padded */
+    uint64_t mask;  /* 0 when the key does not fit in a word */
+} KeyPattern;
+
+static void key_pattern_init(KeyPattern *kp, const char *text) {
+    kp->text = text;
+    kp->len = strlen(text);
+    kp->word = 0;
+    kp->mask = 0;
+    if (kp->len + 1 <= sizeof(uint64_t)) {
+        unsigned char bytes[sizeof(uint64_t)] = {0};
+        unsigned char ones[sizeof(uint64_t)] = {0};
+        memcpy(bytes, text, kp->len);
+        bytes[kp->len] = '"';
+        memset(ones, 0xff, kp->len + 1);
+        memcpy(&kp->word, bytes, sizeof(uint64_t));
+        memcpy(&kp->mask, ones, sizeof(uint64_t));
+    }
+}
+
+/*
+ * The key path (--key), such as "model", "disk.model" or "devices[].model".
+ * Its first step is matched by the scanner against the keys of every
+ * record; the remaining steps are followed into the matching value, where a
+ * name step descends into an object member and "[]" into every array
+ * element.  Values off the path are skipped whole.
+ */
+typedef struct {
+    int each;        /* "[]": every element of an array */
+    KeyPattern key;  /* otherwise: the member with this name */
+} PathStep;
+
+typedef struct {
+    char *source;    /* the path as given */
+    char *names;     /* step names, NUL separated */
+    PathStep *steps;
+    size_t len;
+} KeyPath;
+
+static KeyPath g_key_path;
+static pthread_once_t g_key_path_once = PTHREAD_ONCE_INIT;
+
+static void key_path_free(KeyPath *kp) {
+    free(kp->source);
+    free(kp->names);
+    free(kp->steps);
+    memset(kp, 0, sizeof(*kp));
+}
+
+/* Compiles `text` into kp.  A leading "[]" is allowed and dropped, since the
+ * records of a top-level array are where matching starts anyway.  Returns 0
+ * on a malformed path. */
+static int key_path_compile(KeyPath *kp, const char *text) {
+    KeyPath out;
+    size_t n = strlen(text);
+    out.source = (char *)xmalloc(n + 1);
+    memcpy(out.source, text, n + 1);
+    out.names = (char *)xmalloc(n + 1);
+    out.steps = (PathStep *)xmalloc((n + 1) * sizeof(PathStep));
+    out.len = 0;
+
+    const char *p = strncmp(text, "[]", 2) == 0 ? text + 2 : text;
+    if (*p == '.' && p != text) p++;
+    char *name = out.names;
+    int ok = 1;
+    while (ok && *p) {
+        if (strncmp(p, "[]", 2) == 0 && out.len > 0) {
+            out.steps[out.len].each = 1;
+            out.len++;
+            p += 2;
+        } else {
+            size_t seg = strcspn(p, ".[]");
+            ok = seg > 0;
+            memcpy(name, p, seg);
+            name[seg] = '\0';
+            out.steps[out.len].each = 0;
+            key_pattern_init(&out.steps[out.len].key, name);
+            out.len++;
+            name += seg + 1;
+            p += seg;
+        }
+        /* A name follows a '.'; "[]" follows directly. */
+        if (ok && *p == '.') {
+            p++;
+            ok = *p && *p != '.' && *p != '[';
+        } else if (ok && *p && strncmp(p, "[]", 2) != 0) {
+            ok = 0;
+        }
+    }
+    if (!ok || out.len == 0 || out.steps[0].each) {
+        key_path_free(&out);
+        return 0;
+    }
+    key_path_free(kp);
+    *kp = out;
+    return 1;
+}
+
+static void key_path_default(void) {
+    if (g_key_path.len == 0 && !key_path_compile(&g_key_path, KEY_MODEL)) die("Bad default key");
+}
+
+static const char *key_path_source(void) {
+    return g_key_path.len ? g_key_path.source : KEY_MODEL;
+}
+
+/*
+ * Matches the key whose opening quote was just read and leaves r->p past its
+ * closing quote.  Returns 1 on a match, 0 otherwise and -1 on EOF inside the
+ * key.  Only keys containing escapes (or crossing a stream window) are
+ * materialized, so they compare exactly as decoded by read_json_string.
+ */
+static int match_key(Reader *r, const KeyPattern *kp) {
+    if (kp->mask && r->end - r->p >= (ptrdiff_t)sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, r->p, sizeof(w));
+        if ((w & kp->mask) == kp->word) {
+            r->p += kp->len + 1;
+            return 1;
+        }
+    }
+
+    const unsigned char *q = find_quote_or_backslash(r, r->p);
+    if (q && *q == '"') {
+        int match = (size_t)(q - r->p) == kp->len && memcmp(r->p, kp->text, kp->len) == 0;
+        r->p = q + 1;
+        return match;
+    }
+
+    char *key = read_json_string(r);
+    if (!key) return -1;
+    int match = strcmp(key, kp->text) == 0;
+    free(key);
+    return match;
+}
+
+/* Where a scanner puts the values found at the key path. */
+typedef struct {
+    HashTable *table;
+    uint64_t *models_seen;
+    SeqLog *seq;
+    Scratch sc;
+} ValueSink;
+
+/* Counts the string value whose opening quote was just read. */
+static int count_value(Reader *r, ValueSink *vs) {
+    ValueRef v;
+    if (!read_value(r, &vs->sc, &v)) return 0;
+    table_add_one(vs->table, v.ptr, v.len);
+    if (vs->seq) seqlog_push(vs->seq, seqlog_id(vs->seq, v.ptr, v.len));
+    (*vs->models_seen)++;
+    return 1;
+}
+
+/* Follows the key path from `step` into the value starting with c, counting
+ * the string values at its end.  Returns 0 on malformed input. */
+static int descend_path(Reader *r, size_t step, int c, ValueSink *vs) {
+    if (step == g_key_path.len) {
+        return c == '"' ? count_value(r, vs) : consume_json_value(r, c);
+    }
+    const PathStep *ps = &g_key_path.steps[step];
+    if (c != (ps->each ? '[' : '{')) return consume_json_value(r, c);
+
+    int close = ps->each ? ']' : '}';
+    c = skip_ws(r);
+    if (c == close) return 1;
+    for (;;) {
+        int ok;
+        if (ps->each) {
+            ok = c != EOF && descend_path(r, step + 1, c, vs);
+        } else {
+            int match = c == '"' ? match_key(r, &ps->key) : -1;
+            ok = match >= 0 && skip_ws(r) == ':' && (c = skip_ws(r)) != EOF &&
+                 (match ? descend_path(r, step + 1, c, vs) : consume_json_value(r, c));
+        }
+        if (!ok) return 0;
+        c = skip_ws(r);
+        if (c == close) return 1;
+        if (c != ',') return 0;
+        c = skip_ws(r);
+    }
+}
+
+/*
+ * --group-by: several key paths per record, counted as one composite key.
+ * The key is the tuple of their values packed into one string, joined by
+ * GROUP_SEP, with GROUP_NONE for a field the record lacks.  Neither byte can
+ * occur in a well-formed JSON string (control characters must be escaped,
+ * and escapes decode to '?'), so distinct tuples pack to distinct keys.
+ *
+ * --distinct=PATH reuses the record scanner: its path becomes one more
+ * field after the key fields, with the --key path as the only key field
+ * when there is no --group-by, and its values feed the Distinct sketch of
+ * the record's key instead of becoming part of it.  That lone --key field
+ * keeps the plain scan's counts: every value it reaches is a key of its
+ * own, and takes the --distinct value of the innermost array element the
+ * two paths share (or else of the record).
+ *
+ * --where predicates are fields too, the last ones.  Their values are
+ * tested where they are read, in place unless escaped or cut by the reader
+ * window, and only the outcome is kept; a record is counted at its closing
+ * brace if every predicate held for some value of its field.
+ *
+ * The --bucket-by field sits between the two: its timestamp is parsed where
+ * it is read, and a record without one is not counted.
+ */
+#define GROUP_MAX 16
+#define WHERE_MAX 16
+/* Key fields, then the --distinct and --bucket-by fields, then --where. */
+#define GROUP_FIELDS (GROUP_MAX + 2 + WHERE_MAX)
+#define GROUP_SEP '\x1f'
+#define GROUP_NONE '\x1e'
+
+enum { WHERE_EQ, WHERE_PREFIX, WHERE_LT, WHERE_LE, WHERE_GT, WHERE_GE };
+
+typedef struct {
+    int op;
+    char *text;   /* operand as given */
+    size_t len;
+    double num;   /* operand of the numeric comparisons */
+} Predicate;
+
+static KeyPath g_group[GROUP_FIELDS];
+static size_t g_group_len = 0;   /* fields, the --distinct and --where ones included */
+static size_t g_group_keys = 0;  /* fields that form the key */
+static int g_group_by = 0;       /* the key fields come from --group-by */
+static Predicate g_where[WHERE_MAX];
+static size_t g_where_len = 0;   /* of field g_group_len - g_where_len + i */
+static uint64_t g_where_mask = 0;
+static size_t g_bucket_field = 0;  /* with g_bucket_width */
+static int64_t g_bucket_origin = 0;
+static char *g_bucket_spec = NULL;
+
+static void group_free(void) {
+    for (size_t i = 0; i < g_group_len; ++i) {
+        key_path_free(&g_group[i]);
+    }
+    for (size_t i = 0; i < g_where_len; ++i) {
+        free(g_where[i].text);
+    }
+    g_group_len = 0;
+    g_group_keys = 0;
+    g_group_by = 0;
+    g_distinct = 0;
+    g_where_len = 0;
+    g_where_mask = 0;
+    g_bucket_width = 0;
+    free(g_bucket_spec);
+    g_bucket_spec = NULL;
+}
+
+/* Compiles a comma-separated list of key paths.  Returns 0 on a malformed
+ * path or more than GROUP_MAX of them. */
+static int group_compile(const char *text) {
+    group_free();
+    for (const char *p = text;; ++p) {
+        size_t n = strcspn(p, ",");
+        char *path = (char *)xmalloc(n + 1);
+        memcpy(path, p, n);
+        path[n] = '\0';
+        int ok = g_group_len < GROUP_MAX && key_path_compile(&g_group[g_group_len], path);
+        free(path);
+        if (!ok) {
+            group_free();
+            return 0;
+        }
+        g_group_len++;
+        p += n;
+        if (!*p) break;
+    }
+    g_group_keys = g_group_len;
+    g_group_by = 1;
+    return 1;
+}
+
+/* Without --group-by, the --key path is the only key field. */
+static int group_default_key(void) {
+    if (g_group_len) return 1;
+    if (!key_path_compile(&g_group[0], key_path_source())) return 0;
+    g_group_len = g_group_keys = 1;
+    return 1;
+}
+
+/* Adds the --distinct field after the key fields; call it before
+ * group_bucket() and group_where().  Returns 0 on a malformed path. */
+static int group_distinct(const char *path) {
+    if (!group_default_key() || g_group_len == GROUP_FIELDS || !key_path_compile(&g_group[g_group_len], path)) {
+        return 0;
+    }
+    g_group_len++;
+    g_distinct = 1;
+    return 1;
+}
+
+/*
+ * Sets up --bucket-by=PATH:WIDTH, WIDTH being a count of s, m, h, d or w
+ * (seconds by default).  Buckets are aligned to the epoch, in UTC, except
+ * that weeks start on Monday.  Call it before group_where().  Returns 0 on
+ * a malformed spec.
+ */
+static int group_bucket(const char *spec) {
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || !group_default_key() || g_group_len == GROUP_FIELDS) return 0;
+    char *end = NULL;
+    errno = 0;
+    long long n = strtoll(colon + 1, &end, 10);
+    int64_t unit = 1;
+    switch (*end) {
+        case 's': unit = 1; end++; break;
+        case 'm': unit = 60; end++; break;
+        case 'h': unit = 3600; end++; break;
+        case 'd': unit = 86400; end++; break;
+        case 'w': unit = 7 * 86400; end++; break;
+        default: break;
+    }
+    if (errno || end == colon + 1 || *end || n <= 0 || n > INT64_MAX / unit) return 0;
+
+    size_t at = (size_t)(colon - spec);
+    char *path = (char *)xmalloc(at + 1);
+    memcpy(path, spec, at);
+    path[at] = '\0';
+    int ok = key_path_compile(&g_group[g_group_len], path);
+    free(path);
+    if (!ok) return 0;
+    g_bucket_field = g_group_len++;
+    g_bucket_width = (int64_t)n * unit;
+    g_bucket_origin = unit == 7 * 86400 ? 4 * 86400 : 0;  /* 1970-01-05 was a Monday */
+    size_t len = strlen(spec);
+    g_bucket_spec = (char *)xmalloc(len + 1);
+    memcpy(g_bucket_spec, spec, len + 1);
+    return 1;
+}
+
+/*
+ * Adds a --where predicate: PATH=TEXT (equal), PATH^=TEXT (starts with), or
+ * PATH<N, PATH<=N, PATH>N, PATH>=N on numbers.  Text operands match string
+ * values as decoded and other scalars (numbers, true, false, null) as
+ * written.  Returns 0 on a malformed predicate or more than WHERE_MAX.
+ */
+static int group_where(const char *text) {
+    static const struct {
+        const char *token;
+        int op;
+    } ops[] = {{"^=", WHERE_PREFIX}, {"<=", WHERE_LE}, {">=", WHERE_GE},
+               {"=", WHERE_EQ},      {"<", WHERE_LT},  {">", WHERE_GT}};
+    size_t at = strcspn(text, "^<>=");
+    size_t op = 0;
+    while (op < sizeof(ops) / sizeof(ops[0]) && strncmp(text + at, ops[op].token, strlen(ops[op].token)) != 0) {
+        op++;
+    }
+    if (at == 0 || op == sizeof(ops) / sizeof(ops[0]) || g_where_len == WHERE_MAX || !group_default_key() ||
+        g_group_len == GROUP_FIELDS) {
+        return 0;
+    }
+
+    Predicate pr;
+    const char *operand = text + at + strlen(ops[op].token);
+    pr.op = ops[op].op;
+    pr.len = strlen(operand);
+    pr.text = (char *)xmalloc(pr.len + 1);
+    memcpy(pr.text, operand, pr.len + 1);
+    pr.num = 0.0;
+    char *path = (char *)xmalloc(at + 1);
+    memcpy(path, text, at);
+    path[at] = '\0';
+    int ok = key_path_compile(&g_group[g_group_len], path);
+    free(path);
+    if (ok && pr.op >= WHERE_LT) {
+        char *end = NULL;
+        pr.num = strtod(pr.text, &end);
+        ok = pr.len > 0 && *end == '\0';
+        if (!ok) key_path_free(&g_group[g_group_len]);
+    }
+    if (!ok) {
+        free(pr.text);
+        return 0;
+    }
+    g_where_mask |= (uint64_t)1 << g_group_len;
+    g_where[g_where_len++] = pr;
+    g_group_len++;
+    return 1;
+}
+
+/* Whether a value of a --where field satisfies its predicate.  Numbers
+ * arrive NUL terminated. */
+static int where_holds(const Predicate *pr, const char *p, size_t len, int is_string) {
+    switch (pr->op) {
+        case WHERE_EQ: return len == pr->len && memcmp(p, pr->text, len) == 0;
+        case WHERE_PREFIX: return len >= pr->len && memcmp(p, pr->text, pr->len) == 0;
+        default: break;
+    }
+    if (is_string) return 0;
+    char *end = NULL;
+    double v = strtod(p, &end);
+    if (end == p || *end) return 0;
+    switch (pr->op) {
+        case WHERE_LT: return v < pr->num;
+        case WHERE_LE: return v <= pr->num;
+        case WHERE_GT: return v > pr->num;
+        default: return v >= pr->num;
+    }
+}
+
+/* Days from 1970-01-01 to y-m-d in the proleptic Gregorian calendar
+ * (Hinnant's days_from_civil). */
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/* The n digits at p as a number, or -1 if they are not all digits. */
+static int fixed_digits(const char *p, int n) {
+    int v = 0;
+    for (int i = 0; i < n; ++i) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+/* Days in month m of year y. */
+static int days_in_month(int y, int m) {
+    static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    int leap = y % 4 == 0 && (y % 100 != 0 || y % 400 == 0);
+    return days[m - 1] + (m == 2 && leap);
+}
+
+/*
+ * Parses an ISO-8601 timestamp at fixed positions: YYYY-MM-DD, optionally
+ * followed by 'T' or ' ' and hh:mm[:ss[.fff]], and a zone of Z or
+ * +hh[[:]mm] (UTC when absent).  Days are checked against their month and
+ * hour 24 is only accepted as the 24:00:00 that ends a day.  Sets *t to
+ * seconds since the epoch and returns 1, or returns 0.
+ */
+static int parse_iso8601(const char *p, size_t len, int64_t *t) {
+    if (len < 10 || p[4] != '-' || p[7] != '-') return 0;
+    int y = fixed_digits(p, 4);
+    int mo = fixed_digits(p + 5, 2);
+    int d = fixed_digits(p + 8, 2);
+    if (y < 0 || mo < 1 || mo > 12 || d < 1 || d > days_in_month(y, mo)) return 0;
+    int64_t secs = days_from_civil(y, mo, d) * 86400;
+    size_t i = 10;
+    if (i < len && (p[i] == 'T' || p[i] == 't' || p[i] == ' ')) {
+        if (len < 16 || p[13] != ':') return 0;
+        int h = fixed_digits(p + 11, 2);
+        int mi = fixed_digits(p + 14, 2);
+        int sec = 0;
+        int frac = 0;  /* nonzero fraction digits */
+        i = 16;
+        if (i < len && p[i] == ':') {
+            if (len < 19 || (sec = fixed_digits(p + 17, 2)) < 0) return 0;
+            i = 19;
+            if (i < len && (p[i] == '.' || p[i] == ',')) {
+                for (i++; i < len && p[i] >= '0' && p[i] <= '9'; ++i) {
+                    frac |= p[i] != '0';
+                }
+            }
+        }
+        if (h < 0 || h > 24 || mi < 0 || mi > 59 || sec > 60) return 0;
+        if (h == 24 && (mi || sec || frac)) return 0;
+        secs += h * 3600 + mi * 60 + sec;
+    }
+    if (i < len && (p[i] == 'Z' || p[i] == 'z')) {
+        i++;
+    } else if (i < len && (p[i] == '+' || p[i] == '-')) {
+        int sign = p[i] == '-' ? -1 : 1;
+        int oh = len >= i + 3 ? fixed_digits(p + i + 1, 2) : -1;
+        if (oh < 0 || oh > 23) return 0;
+        i += 3;
+        int om = 0;
+        if (i < len) {
+            i += p[i] == ':';
+            if (len < i + 2 || (om = fixed_digits(p + i, 2)) < 0 || om > 59) return 0;
+            i += 2;
+        }
+        secs -= sign * (oh * 3600 + om * 60);
+    }
+    if (i != len) return 0;
+    *t = secs;
+    return 1;
+}
+
+/* Seconds since the epoch of a timestamp value: ISO-8601, or a number of
+ * seconds (milliseconds from 1e11 on), possibly quoted.  Returns 0 if the
+ * value is neither. */
+static int parse_timestamp(const char *p, size_t len, int64_t *t) {
+    if (parse_iso8601(p, len, t)) return 1;
+    char buf[32];
+    if (len == 0 || len >= sizeof(buf)) return 0;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    char *end = NULL;
+    double v = strtod(buf, &end);
+    if (*end || !(fabs(v) < 9e18)) return 0;
+    if (fabs(v) >= 1e11) v /= 1000.0;
+    *t = (int64_t)floor(v);
+    return 1;
+}
+
+/* Start of the --bucket-by bucket holding t. */
+static int64_t bucket_start(int64_t t) {
+    int64_t off = t - g_bucket_origin;
+    int64_t q = off / g_bucket_width - (off % g_bucket_width < 0);
+    return q * g_bucket_width + g_bucket_origin;
+}
+
+#define SCALAR_MAX 64
+
+/* Reads the rest of the non-string scalar starting with c into buf, NUL
+ * terminated, and leaves r->p where consume_json_value() would.  Returns
+ * its length, or SCALAR_MAX when it does not fit. */
+static size_t read_scalar(Reader *r, int c, char *buf) {
+    size_t n = 0;
+    while (c != EOF && c != ',' && c != '}' && c != ']' && !isspace((unsigned char)c)) {
+        if (n < SCALAR_MAX) buf[n++] = (char)c;
+        c = rd_getc(r);
+    }
+    if (c == ',' || c == '}' || c == ']') rd_ungetc(r);
+    if (n == SCALAR_MAX) return SCALAR_MAX;
+    buf[n] = '\0';
+    return n;
+}
+
+/* Without --group-by, one value of the --key field, at offsets into
+ * GroupRecord.keys; dist_len is SIZE_MAX until it has a --distinct value. */
+typedef struct {
+    size_t at;
+    size_t len;
+    size_t dist_at;
+    size_t dist_len;
+} KeyValue;
+
+/* The fields of the record being scanned. */
+typedef struct {
+    Scratch name;                /* member names while matching */
+    Scratch vals[GROUP_MAX + 1];
+    size_t lens[GROUP_MAX + 1];
+    uint64_t found;              /* fields that have their value */
+    Scratch tuple;
+    int64_t bucket;              /* --bucket-by: start of the record's bucket */
+    Scratch keys;                /* without --group-by: the key values */
+    size_t keys_len;
+    KeyValue *kv;
+    size_t kv_len;
+    size_t kv_cap;
+} GroupRecord;
+
+static void group_record_free(GroupRecord *g) {
+    free(g->name.buf);
+    for (size_t i = 0; i <= GROUP_MAX; ++i) {
+        free(g->vals[i].buf);
+    }
+    free(g->tuple.buf);
+    free(g->keys.buf);
+    free(g->kv);
+}
+
+static void scratch_grow(Scratch *sc, size_t need) {
+    if (need <= sc->cap) return;
+    size_t cap = sc->cap ? sc->cap : 32;
+    while (cap < need) cap *= 2;
+    char *tmp = (char *)realloc(sc->buf, cap);
+    if (!tmp) die("Out of memory");
+    sc->buf = tmp;
+    sc->cap = cap;
+}
+
+/* Appends len bytes to g->keys and returns their offset. */
+static size_t group_keep(GroupRecord *g, const char *p, size_t len) {
+    size_t at = g->keys_len;
+    scratch_grow(&g->keys, at + len);
+    memcpy(g->keys.buf + at, p, len);
+    g->keys_len += len;
+    return at;
+}
+
+/* Without --group-by, adds a value of the --key field. */
+static void group_push_key(GroupRecord *g, const char *p, size_t len) {
+    if (g->kv_len == g->kv_cap) {
+        g->kv_cap = g->kv_cap ? 2 * g->kv_cap : 16;
+        KeyValue *tmp = (KeyValue *)realloc(g->kv, g->kv_cap * sizeof(KeyValue));
+        if (!tmp) die("Out of memory");
+        g->kv = tmp;
+    }
+    KeyValue *kv = &g->kv[g->kv_len++];
+    kv->at = group_keep(g, p, len);
+    kv->len = len;
+    kv->dist_len = SIZE_MAX;
+}
+
+/* Gives the --distinct value found so far, if any, to the key values from
+ * `from` on that have none yet. */
+static void group_pair_distinct(GroupRecord *g, size_t from) {
+    if (!(g->found & ((uint64_t)1 << g_group_keys))) return;
+    size_t at = 0;
+    int kept = 0;
+    for (size_t i = from; i < g->kv_len; ++i) {
+        if (g->kv[i].dist_len != SIZE_MAX) continue;
+        if (!kept) at = group_keep(g, g->vals[g_group_keys].buf, g->lens[g_group_keys]);
+        kept = 1;
+        g->kv[i].dist_at = at;
+        g->kv[i].dist_len = g->lens[g_group_keys];
+    }
+}
+
+/* Tests a value of a --where or --bucket-by field; non-strings arrive NUL
+ * terminated.  Returns 1 if the field is satisfied. */
+static int group_test(GroupRecord *g, size_t i, const char *p, size_t len, int is_string) {
+    if (g_bucket_width && i == g_bucket_field) {
+        int64_t t;
+        if (!parse_timestamp(p, len, &t)) return 0;
+        g->bucket = bucket_start(t);
+        return 1;
+    }
+    return where_holds(&g_where[i - (g_group_len - g_where_len)], p, len, is_string);
+}
+
+/*
+ * Walks the value starting with c at path depth `depth` for the fields in
+ * `active`, whose paths all lead here.  A field whose path ends here takes
+ * the value if it is a string, or tests it if it is a --where field; the
+ * others descend into matching members or, for "[]", into every element.
+ * The first value found for a field wins, except for the lone --key field
+ * without --group-by, which keeps them all; a predicate holds once any
+ * value of its field satisfies it.  Returns 0 on malformed input.
+ */
+static int group_descend(Reader *r, int c, size_t depth, uint64_t active, GroupRecord *g) {
+    uint64_t leaf = 0;
+    uint64_t each = 0;
+    uint64_t named = 0;
+    for (size_t i = 0; i < g_group_len; ++i) {
+        uint64_t bit = (uint64_t)1 << i;
+        if (!(active & bit)) continue;
+        if (g_group[i].len == depth) {
+            leaf |= bit;
+        } else if (g_group[i].steps[depth].each) {
+            each |= bit;
+        } else {
+            named |= bit;
+        }
+    }
+
+    uint64_t multi = g_group_by ? 0 : 1;
+    uint64_t want = leaf & ~(g->found & ~multi);
+    uint64_t tested = g_where_mask | (g_bucket_width ? (uint64_t)1 << g_bucket_field : 0);
+    if (c == '"' && want) {
+        ValueRef v;
+        if (!read_value(r, &g->name, &v)) return 0;
+        for (size_t i = 0; i < g_group_len; ++i) {
+            uint64_t bit = (uint64_t)1 << i;
+            if (!(want & bit)) continue;
+            if (multi & bit) {
+                group_push_key(g, v.ptr, v.len);
+                g->found |= bit;
+                continue;
+            }
+            if (tested & bit) {
+                if (group_test(g, i, v.ptr, v.len, 1)) g->found |= bit;
+                continue;
+            }
+            scratch_grow(&g->vals[i], v.len);
+            memcpy(g->vals[i].buf, v.ptr, v.len);
+            g->lens[i] = v.len;
+            g->found |= bit;
+        }
+        return 1;
+    }
+    if ((want & tested) && c != '"' && c != '{' && c != '[') {
+        char buf[SCALAR_MAX + 1];
+        size_t n = read_scalar(r, c, buf);
+        for (size_t i = 0; n < SCALAR_MAX && i < g_group_len; ++i) {
+            uint64_t bit = (uint64_t)1 << i;
+            if ((want & tested & bit) && group_test(g, i, buf, n, 0)) g->found |= bit;
+        }
+        return 1;
+    }
+    if (!((c == '[' && each) || (c == '{' && named))) return consume_json_value(r, c);
+
+    /* An array both the lone key and the --distinct paths run through pairs
+     * their values element by element. */
+    uint64_t dist = g_distinct ? (uint64_t)1 << g_group_keys : 0;
+    int paired = c == '[' && (each & multi) && (each & dist);
+    int close = c == '[' ? ']' : '}';
+    c = skip_ws(r);
+    if (c == close) return 1;
+    for (;;) {
+        int ok;
+        if (close == ']') {
+            size_t from = g->kv_len;
+            if (paired) g->found &= ~dist;
+            ok = c != EOF && group_descend(r, c, depth + 1, each, g);
+            if (paired) {
+                group_pair_distinct(g, from);
+                g->found &= ~dist;
+            }
+        } else {
+            ValueRef k;
+            ok = c == '"' && read_value(r, &g->name, &k);
+            uint64_t match = 0;
+            for (size_t i = 0; ok && i < g_group_len; ++i) {
+                const KeyPattern *kp = &g_group[i].steps[depth].key;
+                if ((named & ((uint64_t)1 << i)) && kp->len == k.len && memcmp(kp->text, k.ptr, k.len) == 0) {
+                    match |= (uint64_t)1 << i;
+                }
+            }
+            ok = ok && skip_ws(r) == ':' && (c = skip_ws(r)) != EOF &&
+                 (match ? group_descend(r, c, depth + 1, match, g) : consume_json_value(r, c));
+        }
+        if (!ok) return 0;
+        c = skip_ws(r);
+        if (c == close) return 1;
+        if (c != ',') return 0;
+        c = skip_ws(r);
+    }
+}
+
+/* Counts the key, in the record's bucket, and adds dist, unless NULL, to the
+ * key's sketch. */
+static void group_count(HashTable *table, const char *key, size_t len, int64_t bucket, const char *dist,
+                        size_t dist_len) {
+    if (!table->distinct && !table->series) {
+        table_add_one(table, key, len);
+        return;
+    }
+    uint64_t hash = hash_bytes(key, len);
+    table_add(table, key, len, hash, 1);
+    if (table->series) series_add(table->series, key, len, hash, bucket, 1);
+    if (table->distinct && dist) hll_add(distinct_sketch(table->distinct, key, len, hash), hash_bytes(dist, dist_len));
+}
+
+/* Counts the tuple of the record in g, and adds its --distinct value to the
+ * tuple's sketch. */
+static void group_add(HashTable *table, GroupRecord *g) {
+    size_t len = g_group_keys - 1;
+    for (size_t i = 0; i < g_group_keys; ++i) {
+        len += g->found & ((uint64_t)1 << i) ? g->lens[i] : 1;
+    }
+    scratch_grow(&g->tuple, len);
+    char *p = g->tuple.buf;
+    for (size_t i = 0; i < g_group_keys; ++i) {
+        if (i) *p++ = GROUP_SEP;
+        if (g->found & ((uint64_t)1 << i)) {
+            memcpy(p, g->vals[i].buf, g->lens[i]);
+            p += g->lens[i];
+        } else {
+            *p++ = GROUP_NONE;
+        }
+    }
+    int has_dist = (g->found & ((uint64_t)1 << g_group_keys)) != 0;
+    group_count(table, g->tuple.buf, len, g->bucket, has_dist ? g->vals[g_group_keys].buf : NULL,
+                g->lens[g_group_keys]);
+}
+
+typedef struct {
+    const HashTable *table;
+    HashTable *sub;
+} Subtotals;
+
+static void subtotal_entry(const EntryView *e, void *ctx) {
+    static const char sep[] = {GROUP_SEP, '\0'};
+    const Subtotals *st = (const Subtotals *)ctx;
+    const Distinct *d = st->table->distinct;
+    const uint64_t *id = d ? table_find(&d->ids, e->key, e->len, e->hash) : NULL;
+    const char *p = e->key;
+    for (size_t i = 0; i < g_group_keys; ++i) {
+        size_t n = strcspn(p, sep);
+        uint64_t hash = hash_bytes(p, n);
+        table_add(&st->sub[i], p, n, hash, e->count);
+        if (id) hll_merge(distinct_sketch(st->sub[i].distinct, p, n, hash), &d->sketches[*id - 1]);
+        p += n + (p[n] != '\0');
+    }
+}
+
+/* Per-field subtotals of a table of tuples: sub[i], one table per key
+ * field, receives the counts (and distinct sketches) of the values of field
+ * i. */
+static void group_subtotals(const HashTable *table, HashTable *sub) {
+    for (size_t i = 0; i < g_group_keys; ++i) {
+        table_init(&sub[i], INITIAL_BUCKETS);
+        if (table->distinct) sub[i].distinct = distinct_new();
+    }
+    Subtotals st = {table, sub};
+    table_foreach(table, subtotal_entry, &st);
+}
+
+/*
+ * The --group-by scanner.  Every object outside a record, that is at the top
+ * level or directly in a top-level array, is a record; brackets and commas
+ * around records are passed over, so a parallel chunk may start at any
+ * record boundary.  models_seen counts records, or key values without
+ * --group-by.
+ */
+static int scan_groups(Reader *r, HashTable *table, uint64_t *models_seen, Progress *progress) {
+    GroupRecord g;
+    memset(&g, 0, sizeof(g));
+    uint64_t all = (uint64_t)((1ull << g_group_len) - 1);
+    uint64_t required = g_where_mask | (g_bucket_width ? (uint64_t)1 << g_bucket_field : 0);
+    ProgressMark mark;
+    progress_mark(&mark, 0, *models_seen, table);
+    unsigned ticks = 0;
+    int ok = 1;
+    int c;
+    while ((c = skip_ws(r)) != EOF) {
+        if (c == '[' || c == ']' || c == ',') continue;
+        if (c != '{') {
+            if (!consume_json_value(r, c)) {
+                ok = 0;
+                break;
+            }
+            continue;
+        }
+        g.found = 0;
+        g.keys_len = 0;
+        g.kv_len = 0;
+        if (!group_descend(r, c, 0, all, &g)) {
+            ok = 0;
+            break;
+        }
+        if ((g.found & required) != required) continue;
+        if (g_group_by) {
+            group_add(table, &g);
+            (*models_seen)++;
+        } else {
+            /* Every key value counts, as in the plain scan; records lacking
+             * the key are not counted. */
+            group_pair_distinct(&g, 0);
+            for (size_t i = 0; i < g.kv_len; ++i) {
+                const KeyValue *kv = &g.kv[i];
+                const char *d = kv->dist_len == SIZE_MAX ? NULL : g.keys.buf + kv->dist_at;
+                group_count(table, g.keys.buf + kv->at, kv->len, g.bucket, d, kv->dist_len);
+            }
+            *models_seen += g.kv_len;
+        }
+        if (++ticks == PROGRESS_TICK) {
+            if (progress) progress_advance(progress, &mark, rd_input_offset(r), *models_seen, table);
+            ticks = 0;
+        }
+    }
+    if (progress) progress_advance(progress, &mark, rd_input_offset(r), *models_seen, table);
+    group_record_free(&g);
+    return ok;
+}
+
+/*
+ * The scanner.  ck, when not NULL, makes it write serial checkpoints; the
+ * parallel workers checkpoint per chunk instead and pass NULL.  seq, when not
+ * NULL, receives the model of every record for a sidecar.
+ */
+static int scan_input(Reader *r, HashTable *table, uint64_t *models_seen, Progress *progress, Checkpoint *ck,
+                      SeqLog *seq) {
+    if (g_group_len) return scan_groups(r, table, models_seen, progress);
+    ValueSink vs = {table, models_seen, seq, {NULL, 0}};
+    const KeyPattern *root = &g_key_path.steps[0].key;
+    int nested = g_key_path.len > 1;
+    ProgressMark mark;
+    progress_mark(&mark, 0, *models_seen, table);
+    unsigned epoch = 0;
+    unsigned ticks = 0;
+    int ok = 1;
+    int c;
+    for (;;) {
+        if (g_classify) skip_to_quote(r);
+        if ((c = rd_getc(r)) == EOF) break;
+        if (c != '"') continue;
+
+        if (++ticks == PROGRESS_TICK) {
+            if (progress) progress_advance(progress, &mark, rd_input_offset(r), *models_seen, table);
+            if (ck && atomic_load_explicit(&ck->epoch, memory_order_relaxed) != epoch) {
+                /* Restart point: the quote just read. */
+                epoch = atomic_load(&ck->epoch);
+                ck->offset = rd_offset(r) - 1;
+                checkpoint_write(ck, table, *models_seen);
+            }
+            ticks = 0;
+        }
+
+        int is_model = match_key(r, root);
+        if (is_model < 0) {
+            ok = 0;
+            break;
+        }
+
+        c = skip_ws(r);
+        if (c != ':') continue;
+
+        c = skip_ws(r);
+        if (c == EOF) break;
+
+        if (is_model && (nested || c == '"')) {
+            if (!(nested ? descend_path(r, 1, c, &vs) : count_value(r, &vs))) {
+                ok = 0;
+                break;
+            }
+        } else if (!consume_json_value(r, c)) {
+            ok = 0;
+            break;
+        }
+    }
+
+    if (progress) progress_advance(progress, &mark, rd_input_offset(r), *models_seen, table);
+    free(vs.sc.buf);
+    return ok;
+}
+
+/*
+ * Parallel scan of a mapped input.
+ *
+ * The input is cut into fixed-size chunks that workers pick up in order.  A
+ * worker first summarizes its chunk (quote parity and bracket depth change
+ * for either string state at the chunk start), then waits for the exact
+ * lexical state at the chunk start to come down the chain from the previous
+ * chunk, publishes the state at its own end, and finally scans the records
+ * that start inside the chunk.  Records are cut at a ',' at depth 1 (elements
+ * of the top-level array) or a newline at depth 0 (concatenated documents);
+ * at those points the serial scanner is between values, so the union of the
+ * per-chunk results equals the serial result.
+ *
+ * In NDJSON mode every newline ends a record, and a newline can never occur
+ * inside a JSON string, so a chunk is aligned by moving past the next '\n'
+ * alone.  Workers then skip the summary pass and the chain entirely.
+ */
+#define CHUNK_SIZE_DEFAULT ((size_t)64 << 20)
+#define MIN_CHUNK_SIZE ((size_t)1 << 20)
+
+static size_t g_chunk_size = CHUNK_SIZE_DEFAULT;
+static int g_ndjson = 0;
+
+/* Lexical state at a byte position, as consume_json_value tracks it. */
+typedef struct {
+    int in_string;
+    int esc;
+    int64_t depth;
+} ScanState;
+
+/* Structure of one chunk; depth_delta is indexed by in_string at its start. */
+typedef struct {
+    int quotes_odd;
+    int esc_out;
+    int64_t depth_delta[2];
+} ChunkSummary;
+
+/* Continues the summary in sum over [p, end) byte by byte. */
+static void summarize_bytes(const unsigned char *p, const unsigned char *end, ChunkSummary *sum) {
+    int odd = sum->quotes_odd;
+    int esc = sum->esc_out;
+    int64_t delta[2] = {sum->depth_delta[0], sum->depth_delta[1]};
+
+    /* Outside strings a backslash is not valid JSON, so escapes are tracked
+     * the same way under both hypotheses. A byte is structural under the
+     * hypothesis whose start state matches the quote parity so far. */
+    for (; p < end; ++p) {
+        unsigned char c = *p;
+        if (esc) {
+            esc = 0;
+            continue;
+        }
+        switch (c) {
+            case '\\': esc = 1; break;
+            case '"': odd ^= 1; break;
+            case '{': case '[': delta[odd]++; break;
+            case '}': case ']': delta[odd]--; break;
+            default: break;
+        }
+    }
+
+    sum->quotes_odd = odd;
+    sum->esc_out = esc;
+    sum->depth_delta[0] = delta[0];
+    sum->depth_delta[1] = delta[1];
+}
+
+static void summarize_chunk(const unsigned char *p, const unsigned char *end, ChunkSummary *sum) {
+    memset(sum, 0, sizeof(*sum));
+    if (g_classify) {
+        uint64_t esc = 0;
+        uint64_t odd = 0;  /* all ones after an odd number of quotes */
+        for (; end - p >= 64; p += 64) {
+            BlockMasks m;
+            g_classify(p, &m);
+            uint64_t quotes = m.quote & ~find_escaped(m.backslash, &esc);
+            uint64_t str = prefix_xor(quotes) ^ odd;
+            odd = (uint64_t)0 - (str >> 63);
+            sum->depth_delta[0] += __builtin_popcountll(m.open & ~str) - __builtin_popcountll(m.close & ~str);
+            sum->depth_delta[1] += __builtin_popcountll(m.open & str) - __builtin_popcountll(m.close & str);
+        }
+        sum->quotes_odd = (int)(odd & 1);
+        sum->esc_out = (int)esc;
+    }
+    summarize_bytes(p, end, sum);
+}
+
+static ScanState chunk_exit_state(ScanState st, const unsigned char *lo, const unsigned char *hi,
+                                  const ChunkSummary *sum) {
+    ChunkSummary shifted;
+    if (st.esc && lo < hi) {
+        /* The first byte is escaped and was summarized as if it were not. */
+        summarize_chunk(lo + 1, hi, &shifted);
+        sum = &shifted;
+    }
+    ScanState out;
+    out.in_string = st.in_string ^ sum->quotes_odd;
+    out.depth = st.depth + sum->depth_delta[st.in_string];
+    out.esc = sum->esc_out;
+    return out;
+}
+
+/* Start of the first NDJSON record at or after p. */
+static const unsigned char *ndjson_align(const unsigned char *p, const unsigned char *data,
+                                         const unsigned char *end) {
+    if (p == data || p == end) return p;
+    const unsigned char *nl = (const unsigned char *)memchr(p - 1, '\n', (size_t)(end - (p - 1)));
+    return nl ? nl + 1 : end;
+}
+
+/* First record boundary in [p, limit) when p is in state st, or NULL. */
+static const unsigned char *find_record_boundary(const unsigned char *p, const unsigned char *limit,
+                                                 ScanState st) {
+    for (; p < limit; ++p) {
+        unsigned char c = *p;
+        if (st.esc) {
+            st.esc = 0;
+            continue;
+        }
+        if (c == '\\') {
+            st.esc = 1;
+            continue;
+        }
+        if (st.in_string) {
+            if (c == '"') st.in_string = 0;
+            continue;
+        }
+        switch (c) {
+            case '"': st.in_string = 1; break;
+            case '{': case '[': st.depth++; break;
+            case '}': case ']': st.depth--; break;
+            case ',': if (st.depth == 1) return p; break;
+            case '\n': if (st.depth == 0) return p; break;
+            default: break;
+        }
+    }
+    return NULL;
+}
+
+/* The records of one chunk in a worker's sequence log. */
+typedef struct {
+    const SeqLog *log;
+    size_t begin;
+    size_t end;
+} SeqSegment;
+
+typedef struct {
+    const unsigned char *base;  /* mapping base, for absolute offsets */
+    const unsigned char *data;  /* first byte to scan */
+    size_t len;
+    size_t chunk_size;
+    size_t chunk_count;
+    const size_t *frames;       /* zstd frame offsets from data, chunk_count + 1 */
+    ScanState *states;          /* state at the start of each chunk */
+    unsigned char *state_ready;
+    atomic_size_t next_chunk;
+    atomic_int failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t state_cond;
+
+    Progress *progress;
+    Checkpoint *ckpt;
+    SeqSegment *segs;           /* per chunk, when building a sidecar */
+    OffsetIndex *index;         /* record boundaries to use or fill in */
+} ParallelScan;
+
+typedef struct {
+    ParallelScan *ps;
+    HashTable table;
+    uint64_t models_seen;
+    ProgressMark mark;    /* what this worker has added to ps->progress */
+    int ok;
+    SeqLog *log;          /* records for a sidecar, or NULL */
+
+    /* Chunks counted in table since the last checkpoint fold. */
+    size_t *pending;
+    size_t pending_len;
+    unsigned epoch;
+} ParallelWorker;
+
+/* Geometry check and setup for a checkpointed parallel scan. */
+static int checkpoint_begin_chunks(Checkpoint *ck, uint64_t chunk_size, size_t chunk_count, int threads) {
+    if (ck->loaded) {
+        if (ck->kind != CKPT_CHUNKS || ck->chunk_size != chunk_size || ck->chunk_count != chunk_count) {
+            fprintf(stderr, "Checkpoint '%s' does not match this scan; resume with the same -j\n", ck->path);
+            return 0;
+        }
+    } else {
+        ck->kind = CKPT_CHUNKS;
+        ck->chunk_size = chunk_size;
+        ck->chunk_count = chunk_count;
+        ck->done = (unsigned char *)calloc(chunk_count + 1, 1);
+        if (!ck->done) die("Out of memory");
+    }
+    ck->active = threads;
+    ck->folded = 0;
+    return 1;
+}
+
+/* Moves a worker's finished chunks and their counts into the checkpoint,
+ * and writes it once every running worker has folded.  Caller holds
+ * ck->lock. */
+static void checkpoint_fold(Checkpoint *ck, ParallelWorker *w) {
+    for (size_t i = 0; i < w->pending_len; ++i) {
+        ck->done[w->pending[i]] = 1;
+    }
+    w->pending_len = 0;
+    table_merge(&ck->table, &w->table);
+    ck->models_seen += w->models_seen;
+
+    /* The worker starts over with an empty table; its progress mark keeps
+     * the old arena figures so the release shows up in the totals. */
+    table_free(&w->table);
+    table_init(&w->table, INITIAL_BUCKETS);
+    w->models_seen = 0;
+    w->mark.models = 0;
+
+    if (++ck->folded >= ck->active) {
+        checkpoint_write(ck, &ck->table, ck->models_seen);
+        ck->folded = 0;
+    }
+}
+
+/* Records chunk k as counted in w->table, folding when a checkpoint is due. */
+static void checkpoint_chunk(Checkpoint *ck, ParallelWorker *w, size_t k) {
+    w->pending[w->pending_len++] = k;
+    unsigned epoch = atomic_load_explicit(&ck->epoch, memory_order_relaxed);
+    if (epoch != w->epoch) {
+        w->epoch = epoch;
+        pthread_mutex_lock(&ck->lock);
+        checkpoint_fold(ck, w);
+        pthread_mutex_unlock(&ck->lock);
+    }
+}
+
+static void checkpoint_leave(Checkpoint *ck) {
+    pthread_mutex_lock(&ck->lock);
+    ck->active--;
+    if (ck->folded > 0 && ck->folded >= ck->active) {
+        checkpoint_write(ck, &ck->table, ck->models_seen);
+        ck->folded = 0;
+    }
+    pthread_mutex_unlock(&ck->lock);
+}
+
+/* Whether chunk k was finished before a resume. */
+static inline int chunk_done(const ParallelScan *ps, size_t k) {
+    return ps->ckpt && ps->ckpt->done[k];
+}
+
+/* Adds a finished chunk to the shared progress totals. */
+static void parallel_report(ParallelWorker *w, size_t chunk_bytes) {
+    if (w->ps->progress) {
+        progress_advance(w->ps->progress, &w->mark, w->mark.bytes + chunk_bytes, w->models_seen, &w->table);
+    }
+}
+
+/* Locates the records [*start, *stop) that begin inside chunk k = [lo, hi).
+ * Returns 0 when there are none or the scan has already failed. */
+static int chunk_records(ParallelScan *ps, size_t k, const unsigned char *lo, const unsigned char *hi,
+                         const unsigned char **start, const unsigned char **stop) {
+    const unsigned char *file_end = ps->data + ps->len;
+
+    if (g_ndjson) {
+        *start = ndjson_align(lo, ps->data, file_end);
+        *stop = ndjson_align(hi, ps->data, file_end);
+        return *start < *stop && !atomic_load(&ps->failed);
+    }
+
+    OffsetIndex *ix = ps->index;
+    if (ix && ix->loaded) {
+        *start = ps->data + ix->offsets[(size_t)(lo - ps->data) / ix->stride];
+        *stop = hi == file_end ? file_end : ps->data + ix->offsets[(size_t)(hi - ps->data) / ix->stride];
+        if (k == 0) *start = lo;
+        return *start < *stop && !atomic_load(&ps->failed);
+    }
+
+    /* When building the index the chunk is summarized a stride at a time, so
+     * the state at every stride start is known once the chunk's is. */
+    size_t step = ix ? (size_t)ix->stride : (size_t)(hi - lo);
+    size_t parts = ix ? ((size_t)(hi - lo) + step - 1) / step : 1;
+    ChunkSummary one;
+    ChunkSummary *sums = parts > 1 ? (ChunkSummary *)xmalloc(parts * sizeof(ChunkSummary)) : &one;
+    ScanState *part_states = ix ? (ScanState *)xmalloc(parts * sizeof(ScanState)) : NULL;
+    for (size_t j = 0; j < parts; ++j) {
+        const unsigned char *q = lo + j * step;
+        summarize_chunk(q, hi - q > (ptrdiff_t)step ? q + step : hi, &sums[j]);
+    }
+
+    pthread_mutex_lock(&ps->lock);
+    while (!ps->state_ready[k]) {
+        pthread_cond_wait(&ps->state_cond, &ps->lock);
+    }
+    ScanState st = ps->states[k];
+    ScanState next = st;
+    for (size_t j = 0; j < parts; ++j) {
+        const unsigned char *q = lo + j * step;
+        if (part_states) part_states[j] = next;
+        next = chunk_exit_state(next, q, hi - q > (ptrdiff_t)step ? q + step : hi, &sums[j]);
+    }
+    if (k + 1 < ps->chunk_count) {
+        ps->states[k + 1] = next;
+        ps->state_ready[k + 1] = 1;
+        pthread_cond_broadcast(&ps->state_cond);
+    }
+    pthread_mutex_unlock(&ps->lock);
+
+    /* The first record boundary at or after hi, if there is a next chunk. */
+    const unsigned char *after = k + 1 < ps->chunk_count ? find_record_boundary(hi, file_end, next) : NULL;
+    *stop = after ? after : file_end;
+
+    /* Each stride is searched only up to the next stride start; a stride
+     * without a boundary of its own takes the next one found after it, so
+     * strides are walked from the last, and no byte is searched twice. */
+    const unsigned char *first = NULL;
+    if (part_states) {
+        for (size_t j = parts; j-- > 0;) {
+            const unsigned char *q = lo + j * step;
+            const unsigned char *end = hi - q > (ptrdiff_t)step ? q + step : hi;
+            const unsigned char *b = q == ps->data ? q : find_record_boundary(q, end, part_states[j]);
+            if (b) after = b;
+            ix->offsets[(size_t)(q - ps->data) / step] = after ? (uint64_t)(after - ps->data) : (uint64_t)ps->len;
+            if (j == 0 && after && after < hi) first = after;
+        }
+        free(part_states);
+    }
+    if (sums != &one) free(sums);
+    if (atomic_load(&ps->failed)) return 0;
+
+    if (k == 0) {
+        *start = lo;
+    } else {
+        *start = ix ? first : find_record_boundary(lo, hi, st);
+    }
+    return *start != NULL;
+}
+
+static void *parallel_worker(void *arg) {
+    ParallelWorker *w = (ParallelWorker *)arg;
+    ParallelScan *ps = w->ps;
+
+    for (;;) {
+        size_t k = atomic_fetch_add(&ps->next_chunk, 1);
+        if (k >= ps->chunk_count) break;
+
+        const unsigned char *lo = ps->data + k * ps->chunk_size;
+        const unsigned char *hi = k + 1 == ps->chunk_count ? ps->data + ps->len : lo + ps->chunk_size;
+        const unsigned char *start;
+        const unsigned char *stop;
+        if (chunk_records(ps, k, lo, hi, &start, &stop) && !chunk_done(ps, k)) {
+            Reader r;
+            memset(&r, 0, sizeof(r));
+            r.base = ps->base;
+            r.p = start;
+            r.end = stop;
+            size_t begin = w->log ? w->log->len : 0;
+            if (!scan_input(&r, &w->table, &w->models_seen, NULL, NULL, w->log)) {
+                atomic_store(&ps->failed, 1);
+                w->ok = 0;
+            }
+            if (w->log) ps->segs[k] = (SeqSegment){w->log, begin, w->log->len};
+        }
+        if (ps->ckpt && w->ok && !chunk_done(ps, k)) checkpoint_chunk(ps->ckpt, w, k);
+        parallel_report(w, (size_t)(hi - lo));
+    }
+    if (ps->ckpt) checkpoint_leave(ps->ckpt);
+    return NULL;
+}
+
+/* Appends the records of every chunk to dst, in chunk order. */
+static void seq_collect(SeqLog *dst, const ParallelScan *ps, const SeqLog *logs, int threads) {
+    uint32_t **maps = (uint32_t **)xmalloc((size_t)threads * sizeof(uint32_t *));
+    for (int i = 0; i < threads; ++i) {
+        maps[i] = seqlog_remap(dst, &logs[i]);
+    }
+    for (size_t k = 0; k < ps->chunk_count; ++k) {
+        const SeqSegment *seg = &ps->segs[k];
+        if (!seg->log) continue;
+        const uint32_t *map = maps[seg->log - logs];
+        for (size_t j = seg->begin; j < seg->end; ++j) {
+            seqlog_push(dst, map[seg->log->seq[j]]);
+        }
+    }
+    for (int i = 0; i < threads; ++i) {
+        free(maps[i]);
+    }
+    free(maps);
+}
+
+/* Runs `threads` copies of worker over the chunks of ps and merges their
+ * tables into `table`. */
+static int run_workers(ParallelScan *ps, void *(*worker)(void *), int threads, HashTable *table,
+                       uint64_t *models_seen) {
+    if (ps->ckpt && !checkpoint_begin_chunks(ps->ckpt, ps->chunk_size, ps->chunk_count, threads)) return 0;
+
+    ps->states = (ScanState *)xmalloc(ps->chunk_count * sizeof(ScanState));
+    ps->state_ready = (unsigned char *)calloc(ps->chunk_count, 1);
+    if (!ps->state_ready) die("Out of memory");
+    memset(&ps->states[0], 0, sizeof(ScanState));
+    ps->state_ready[0] = 1;
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->state_cond, NULL);
+
+    ParallelWorker *workers = (ParallelWorker *)xmalloc((size_t)threads * sizeof(ParallelWorker));
+    pthread_t *tids = (pthread_t *)xmalloc((size_t)threads * sizeof(pthread_t));
+    SeqLog *logs = NULL;
+    if (g_sidecar) {
+        logs = (SeqLog *)xmalloc((size_t)threads * sizeof(SeqLog));
+        ps->segs = (SeqSegment *)calloc(ps->chunk_count, sizeof(SeqSegment));
+        if (!ps->segs) die("Out of memory");
+    }
+    int ok = 1;
+    for (int i = 0; i < threads; ++i) {
+        workers[i].ps = ps;
+        workers[i].models_seen = 0;
+        workers[i].ok = 1;
+        workers[i].log = logs ? &logs[i] : NULL;
+        if (logs) seqlog_init(&logs[i]);
+        workers[i].pending = ps->ckpt ? (size_t *)xmalloc(ps->chunk_count * sizeof(size_t)) : NULL;
+        workers[i].pending_len = 0;
+        workers[i].epoch = 0;
+        counts_init(&workers[i].table);
+        progress_mark(&workers[i].mark, 0, 0, &workers[i].table);
+        if (pthread_create(&tids[i], NULL, worker, &workers[i]) != 0) {
+            die("Cannot create worker thread");
+        }
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+        ok &= workers[i].ok;
+        table_merge(table, &workers[i].table);
+        *models_seen += workers[i].models_seen;
+        table_free(&workers[i].table);
+        free(workers[i].pending);
+    }
+    if (ps->ckpt && ok) {
+        table_merge(table, &ps->ckpt->table);
+        *models_seen += ps->ckpt->models_seen;
+    }
+    if (logs) {
+        if (ok) seq_collect(&g_sidecar->log, ps, logs, threads);
+        for (int i = 0; i < threads; ++i) {
+            seqlog_free(&logs[i]);
+        }
+        free(logs);
+        free(ps->segs);
+    }
+
+    free(tids);
+    free(workers);
+    pthread_cond_destroy(&ps->state_cond);
+    pthread_mutex_destroy(&ps->lock);
+    free(ps->state_ready);
+    free(ps->states);
+    return ok;
+}
+
+static void parallel_init(ParallelScan *ps, const Reader *r, Progress *progress, const HashTable *table,
+                          uint64_t models_seen) {
+    memset(ps, 0, sizeof(*ps));
+    ps->base = r->base;
+    ps->data = r->p;
+    ps->len = (size_t)(r->end - r->p);
+    ps->progress = progress;
+    ps->ckpt = g_checkpoint;
+    atomic_init(&ps->next_chunk, 0);
+    atomic_init(&ps->failed, 0);
+    if (progress) {
+        /* Bytes before the starting position count as done. */
+        ProgressMark m;
+        progress_mark(&m, 0, models_seen, table);
+        progress_advance(progress, &m, (uint64_t)(r->p - r->base), models_seen, table);
+    }
+}
+
+/* Scans the window of a mapped reader with `threads` workers and merges their
+ * tables into `table`. */
+static int scan_mapped_parallel(Reader *r, int threads, HashTable *table, uint64_t *models_seen,
+                                Progress *progress) {
+    ParallelScan ps;
+    parallel_init(&ps, r, progress, table, *models_seen);
+
+    size_t chunk = ps.len / ((size_t)threads * 4);
+    if (chunk < MIN_CHUNK_SIZE) chunk = MIN_CHUNK_SIZE;
+    if (chunk > g_chunk_size) chunk = g_chunk_size;
+    if (g_index && !g_ndjson && r->p == r->base && ps.len == g_index->input_size) {
+        /* Chunks start at stride boundaries, where the index has entries. */
+        ps.index = g_index;
+        chunk = chunk < g_index->stride ? (size_t)g_index->stride : chunk - chunk % g_index->stride;
+    }
+    if (ps.ckpt && ps.ckpt->loaded && ps.ckpt->kind == CKPT_CHUNKS && ps.ckpt->chunk_size) {
+        chunk = (size_t)ps.ckpt->chunk_size;  /* keep the checkpoint's geometry */
+        if (ps.index && chunk % ps.index->stride != 0) ps.index = NULL;
+    }
+    ps.chunk_size = chunk;
+    ps.chunk_count = ps.len ? (ps.len + chunk - 1) / chunk : 0;
+    if (ps.chunk_count == 0) return 1;
+    int ok = run_workers(&ps, parallel_worker, threads, table, models_seen);
+    if (ok && ps.index && !ps.index->loaded) ps.index->built = 1;
+    return ok;
+}
+
+#ifdef HAVE_ZSTD
+/*
+ * Parallel scan of a mapped multi-frame zstd input (including the seekable
+ * format, whose seek table is a skippable frame).  Frames play the part of
+ * chunks: a worker decodes a whole frame, summarizes it, takes its place in
+ * the state chain and scans the records that start inside it.  Frames need
+ * not end on record boundaries, so the last record is completed by decoding
+ * the following frames only as far as the next boundary.
+ */
+#define FRAME_PEEK_SIZE ((size_t)64 << 10)
+
+/* Offsets of the data frames in [p, p + len), ending with len.  Returns the
+ * number of frames, or 0 if the input is not a clean frame sequence. */
+static size_t zstd_frames(const unsigned char *p, size_t len, size_t **out) {
+    size_t count = 0;
+    size_t cap = 16;
+    size_t *frames = (size_t *)xmalloc((cap + 1) * sizeof(size_t));
+    for (size_t pos = 0; pos < len;) {
+        size_t n = ZSTD_findFrameCompressedSize(p + pos, len - pos);
+        if (ZSTD_isError(n) || n == 0) {
+            free(frames);
+            return 0;
+        }
+        uint32_t magic;
+        memcpy(&magic, p + pos, 4);
+        if ((magic & 0xfffffff0u) != 0x184d2a50u) {
+            if (count == cap) {
+                cap *= 2;
+                size_t *tmp = (size_t *)realloc(frames, (cap + 1) * sizeof(size_t));
+                if (!tmp) die("Out of memory");
+                frames = tmp;
+            }
+            frames[count++] = pos;
+        }
+        pos += n;
+    }
+    frames[count] = len;
+    *out = frames;
+    return count;
+}
+
+static void scratch_reserve(Scratch *sc, size_t need) {
+    if (need <= sc->cap) return;
+    size_t cap = sc->cap ? sc->cap : FRAME_PEEK_SIZE;
+    while (cap < need) cap *= 2;
+    char *tmp = (char *)realloc(sc->buf, cap);
+    if (!tmp) die("Out of memory");
+    sc->buf = tmp;
+    sc->cap = cap;
+}
+
+/* Decodes from ib, appending to sc at *len, until at least `want` more bytes
+ * are out or the frame ends.  Returns 1 at the frame end, 0 if there is
+ * more, -1 on error. */
+static int zstd_decode_some(ZSTD_DCtx *dctx, ZSTD_inBuffer *ib, Scratch *sc, size_t *len, size_t want) {
+    size_t goal = *len + want;
+    for (;;) {
+        scratch_reserve(sc, *len + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer ob = {sc->buf, sc->cap, *len};
+        size_t rc = ZSTD_decompressStream(dctx, &ob, ib);
+        *len = ob.pos;
+        if (ZSTD_isError(rc)) return -1;
+        if (rc == 0) return 1;
+        if (ib->pos == ib->size && ob.pos < ob.size) return -1;  /* truncated frame */
+        if (*len >= goal) return 0;
+    }
+}
+
+/* A worker's decompression context and output buffer, reused across frames. */
+typedef struct {
+    ZSTD_DCtx *dctx;
+    Scratch out;
+} FrameDecoder;
+
+static ZSTD_inBuffer frame_input(const ParallelScan *ps, size_t k) {
+    ZSTD_inBuffer ib = {ps->data + ps->frames[k], ps->frames[k + 1] - ps->frames[k], 0};
+    return ib;
+}
+
+/* Appends frames after k to fd->out (ending at *len) until the first record
+ * boundary after the end of frame k, entered in state st.  Returns the
+ * boundary's offset, *len if the input ends first, or -1 on error. */
+static ptrdiff_t frame_extend(ParallelScan *ps, FrameDecoder *fd, size_t k, ScanState st, size_t *len) {
+    for (size_t j = k + 1; j < ps->chunk_count; ++j) {
+        size_t seg = *len;
+        size_t want = FRAME_PEEK_SIZE;
+        ZSTD_inBuffer ib = frame_input(ps, j);
+        ZSTD_DCtx_reset(fd->dctx, ZSTD_reset_session_only);
+        for (;;) {
+            int rc = zstd_decode_some(fd->dctx, &ib, &fd->out, len, want);
+            if (rc < 0) return -1;
+            const unsigned char *lo = (const unsigned char *)fd->out.buf + seg;
+            const unsigned char *hi = (const unsigned char *)fd->out.buf + *len;
+            const unsigned char *stop = find_record_boundary(lo, hi, st);
+            if (stop) return stop - (const unsigned char *)fd->out.buf;
+            if (rc == 1) {
+                ChunkSummary sum;
+                summarize_chunk(lo, hi, &sum);
+                st = chunk_exit_state(st, lo, hi, &sum);
+                break;
+            }
+            want *= 2;
+        }
+    }
+    return (ptrdiff_t)*len;
+}
+
+static void *frame_worker(void *arg) {
+    ParallelWorker *w = (ParallelWorker *)arg;
+    ParallelScan *ps = w->ps;
+    FrameDecoder fd = {ZSTD_createDCtx(), {NULL, 0}};
+    if (!fd.dctx) die("Out of memory");
+
+    for (;;) {
+        size_t k = atomic_fetch_add(&ps->next_chunk, 1);
+        if (k >= ps->chunk_count) break;
+
+        size_t len = 0;
+        ZSTD_inBuffer ib = frame_input(ps, k);
+        ZSTD_DCtx_reset(fd.dctx, ZSTD_reset_session_only);
+        int decoded = zstd_decode_some(fd.dctx, &ib, &fd.out, &len, SIZE_MAX / 2) == 1;
+        const unsigned char *lo = (const unsigned char *)fd.out.buf;
+        const unsigned char *hi = lo + len;
+
+        /* A frame that fails to decode still passes a state down the chain,
+         * so the others finish; the scan as a whole fails. */
+        ChunkSummary sum;
+        summarize_chunk(lo, hi, &sum);
+        pthread_mutex_lock(&ps->lock);
+        while (!ps->state_ready[k]) {
+            pthread_cond_wait(&ps->state_cond, &ps->lock);
+        }
+        ScanState st = ps->states[k];
+        ScanState next = chunk_exit_state(st, lo, hi, &sum);
+        if (k + 1 < ps->chunk_count) {
+            ps->states[k + 1] = next;
+            ps->state_ready[k + 1] = 1;
+            pthread_cond_broadcast(&ps->state_cond);
+        }
+        pthread_mutex_unlock(&ps->lock);
+
+        const unsigned char *start = k == 0 ? lo : find_record_boundary(lo, hi, st);
+        size_t from = start ? (size_t)(start - lo) : 0;
+        ptrdiff_t stop = -1;
+        if (decoded && start && !chunk_done(ps, k)) stop = frame_extend(ps, &fd, k, next, &len);
+        if (!decoded || (start && stop < 0)) {
+            atomic_store(&ps->failed, 1);
+            w->ok = 0;
+        } else if (start && !chunk_done(ps, k) && !atomic_load(&ps->failed)) {
+            /* frame_extend may have moved the buffer. */
+            Reader r;
+            memset(&r, 0, sizeof(r));
+            r.base = (const unsigned char *)fd.out.buf;
+            r.p = r.base + from;
+            r.end = r.base + stop;
+            size_t begin = w->log ? w->log->len : 0;
+            if (!scan_input(&r, &w->table, &w->models_seen, NULL, NULL, w->log)) {
+                atomic_store(&ps->failed, 1);
+                w->ok = 0;
+            }
+            if (w->log) ps->segs[k] = (SeqSegment){w->log, begin, w->log->len};
+        }
+        if (ps->ckpt && w->ok && !chunk_done(ps, k)) checkpoint_chunk(ps->ckpt, w, k);
+        parallel_report(w, ps->frames[k + 1] - ps->frames[k]);
+    }
+    if (ps->ckpt) checkpoint_leave(ps->ckpt);
+
+    free(fd.out.buf);
+    ZSTD_freeDCtx(fd.dctx);
+    return NULL;
+}
+
+/* Scans a mapped zstd input frame by frame in parallel.  Returns -1 when the
+ * input has fewer than two data frames, leaving it to the stream decoder. */
+static int scan_zstd_frames(Reader *r, int threads, HashTable *table, uint64_t *models_seen,
+                            Progress *progress) {
+    ParallelScan ps;
+    parallel_init(&ps, r, progress, table, *models_seen);
+
+    size_t *frames = NULL;
+    ps.chunk_count = zstd_frames(ps.data, ps.len, &frames);
+    if (ps.chunk_count < 2) {
+        free(frames);
+        return -1;
+    }
+    ps.frames = frames;
+    int ok = run_workers(&ps, frame_worker, threads, table, models_seen);
+    free(frames);
+    return ok;
+}
+#endif
+
+/* Scans fp from its current position, mapping it when possible.  Mapped inputs
+ * are split across `threads` workers. */
+static int process_file_parallel(FILE *fp, HashTable *table, uint64_t *models_seen, Progress *progress,
+                                 int threads) {
+    pthread_once(&g_key_path_once, key_path_default);
+
+    Reader r;
+    reader_open(&r, fp);
+    int ok = -1;
+#ifdef HAVE_ZSTD
+    if (threads > 1 && r.map && r.format == DEC_ZSTD) {
+        ok = scan_zstd_frames(&r, threads, table, models_seen, progress);
+    }
+#endif
+    if (ok < 0) {
+        if (threads > 1 && r.map && r.format < 0) {
+            ok = scan_mapped_parallel(&r, threads, table, models_seen, progress);
+        } else {
+            reader_decode(&r);
+            ok = (!g_checkpoint || checkpoint_begin_serial(g_checkpoint, &r, table, models_seen)) &&
+                 scan_input(&r, table, models_seen, progress, g_checkpoint, g_sidecar ? &g_sidecar->log : NULL);
+        }
+    }
+    if (!reader_close(&r)) ok = 0;
+    return ok;
+}
+
+static int process_file(FILE *fp, HashTable *table, uint64_t *models_seen, Progress *progress) {
+    return process_file_parallel(fp, table, models_seen, progress, 1);
+}
+
+/*
+ * Input sets.  Arguments may name files, directories (searched recursively,
+ * in name order, for regular files) or glob patterns that the shell left
+ * unexpanded; "-" is standard input.
+ */
+typedef struct {
+    char *path;
+    uint64_t size;
+} Input;
+
+typedef struct {
+    Input *items;
+    size_t len;
+    size_t cap;
+} InputList;
+
+static void inputs_push(InputList *l, const char *path, uint64_t size) {
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 16;
+        Input *tmp = (Input *)realloc(l->items, l->cap * sizeof(Input));
+        if (!tmp) die("Out of memory");
+        l->items = tmp;
+    }
+    size_t n = strlen(path) + 1;
+    l->items[l->len].path = (char *)xmalloc(n);
+    memcpy(l->items[l->len].path, path, n);
+    l->items[l->len].size = size;
+    l->len++;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int inputs_add_dir(InputList *l, const char *dir);
+
+/* Adds the inputs named by arg.  Returns 0, after a message, when arg names
+ * nothing readable. */
+static int inputs_add(InputList *l, const char *arg) {
+    if (strcmp(arg, "-") == 0) {
+        inputs_push(l, arg, 0);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(arg, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) return inputs_add_dir(l, arg);
+        inputs_push(l, arg, S_ISREG(st.st_mode) ? (uint64_t)st.st_size : 0);
+        return 1;
+    }
+
+    if (strpbrk(arg, "*?[")) {
+        glob_t g;
+        int rc = glob(arg, 0, NULL, &g);
+        if (rc == 0) {
+            int ok = 1;
+            for (size_t i = 0; i < g.gl_pathc; ++i) {
+                ok &= inputs_add(l, g.gl_pathv[i]);
+            }
+            globfree(&g);
+            return ok;
+        }
+        if (rc == GLOB_NOMATCH) {
+            fprintf(stderr, "No files match '%s'\n", arg);
+            return 0;
+        }
+    }
+    fprintf(stderr, "Cannot open '%s': %s\n", arg, strerror(errno));
+    return 0;
+}
+
+static int inputs_add_dir(InputList *l, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Cannot open '%s': %s\n", dir, strerror(errno));
+        return 0;
+    }
+
+    char **names = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char **tmp = (char **)realloc(names, cap * sizeof(char *));
+            if (!tmp) die("Out of memory");
+            names = tmp;
+        }
+        size_t n = strlen(dir) + strlen(de->d_name) + 2;
+        names[count] = (char *)xmalloc(n);
+        snprintf(names[count], n, "%s/%s", dir, de->d_name);
+        count++;
+    }
+    closedir(d);
+    if (count) qsort(names, count, sizeof(char *), name_cmp);
+
+    int ok = 1;
+    for (size_t i = 0; i < count; ++i) {
+        struct stat st;
+        if (stat(names[i], &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                ok &= inputs_add_dir(l, names[i]);
+            } else if (S_ISREG(st.st_mode)) {
+                inputs_push(l, names[i], (uint64_t)st.st_size);
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+static void inputs_free(InputList *l) {
+    for (size_t i = 0; i < l->len; ++i) {
+        free(l->items[i].path);
+    }
+    free(l->items);
+    memset(l, 0, sizeof(*l));
+}
+
+static FILE *input_open(const Input *in) {
+    return strcmp(in->path, "-") == 0 ? stdin : fopen(in->path, "rb");
+}
+
+static void input_close(FILE *fp) {
+    if (fp != stdin) fclose(fp);
+}
+
+/*
+ * Multi-file scan.  Files are handed to a pool of workers largest first,
+ * so the long jobs start early and small files fill in behind them; each
+ * worker scans whole files serially into its own table, and the tables are
+ * merged at the end.  A single input instead gets the chunked parallel scan.
+ */
+typedef struct {
+    const InputList *inputs;
+    size_t *order;            /* input indices, largest first */
+    atomic_size_t next;
+    Progress *progress;
+    HashTable *per_file;      /* one table per input, or NULL */
+    int *status;              /* per input: 1 ok, 0 parse error, -errno if unopened */
+} FilePool;
+
+typedef struct {
+    FilePool *pool;
+    HashTable table;
+    uint64_t models_seen;
+} FileWorker;
+
+static const InputList *g_sort_inputs;
+
+static int input_size_cmp(const void *a, const void *b) {
+    const Input *ia = &g_sort_inputs->items[*(const size_t *)a];
+    const Input *ib = &g_sort_inputs->items[*(const size_t *)b];
+    if (ia->size != ib->size) return ia->size < ib->size ? 1 : -1;
+    return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+static void *file_worker(void *arg) {
+    FileWorker *w = (FileWorker *)arg;
+    FilePool *pool = w->pool;
+    for (;;) {
+        size_t k = atomic_fetch_add(&pool->next, 1);
+        if (k >= pool->inputs->len) break;
+
+        size_t i = pool->order[k];
+        const Input *in = &pool->inputs->items[i];
+        FILE *fp = input_open(in);
+        if (!fp) {
+            pool->status[i] = -errno;
+            continue;
+        }
+        if (pool->per_file) {
+            uint64_t seen = 0;
+            pool->status[i] = process_file(fp, &pool->per_file[i], &seen, pool->progress);
+            table_merge(&w->table, &pool->per_file[i]);
+            w->models_seen += seen;
+        } else {
+            pool->status[i] = process_file(fp, &w->table, &w->models_seen, pool->progress);
+        }
+        input_close(fp);
+    }
+    return NULL;
+}
+
+/* Scans every input into `table`, and into per_file[i] (initialized by the
+ * caller) when per_file is not NULL.  status[i] reports each input as in
+ * FilePool.  Returns 1 when all inputs were read cleanly. */
+static int process_files(const InputList *inputs, int threads, HashTable *table, uint64_t *models_seen,
+                         Progress *progress, HashTable *per_file, int *status) {
+    if (inputs->len == 1) {
+        FILE *fp = input_open(&inputs->items[0]);
+        if (!fp) {
+            status[0] = -errno;
+            return 0;
+        }
+        status[0] = process_file_parallel(fp, per_file ? &per_file[0] : table, models_seen, progress, threads);
+        if (per_file) table_merge(table, &per_file[0]);
+        input_close(fp);
+        return status[0] == 1;
+    }
+
+    FilePool pool;
+    pool.inputs = inputs;
+    pool.order = (size_t *)xmalloc((inputs->len ? inputs->len : 1) * sizeof(size_t));
+    for (size_t i = 0; i < inputs->len; ++i) pool.order[i] = i;
+    g_sort_inputs = inputs;
+    qsort(pool.order, inputs->len, sizeof(size_t), input_size_cmp);
+    atomic_init(&pool.next, 0);
+    pool.progress = progress;
+    pool.per_file = per_file;
+    pool.status = status;
+
+    if ((size_t)threads > inputs->len) threads = inputs->len ? (int)inputs->len : 1;
+    FileWorker *workers = (FileWorker *)xmalloc((size_t)threads * sizeof(FileWorker));
+    pthread_t *tids = (pthread_t *)xmalloc((size_t)threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; ++i) {
+        workers[i].pool = &pool;
+        workers[i].models_seen = 0;
+        counts_init(&workers[i].table);
+        if (pthread_create(&tids[i], NULL, file_worker, &workers[i]) != 0) {
+            die("Cannot create worker thread");
+        }
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+        table_merge(table, &workers[i].table);
+        *models_seen += workers[i].models_seen;
+        table_free(&workers[i].table);
+    }
+    free(tids);
+    free(workers);
+    free(pool.order);
+
+    int ok = 1;
+    for (size_t i = 0; i < inputs->len; ++i) {
+        if (status[i] != 1) ok = 0;
+    }
+    return ok;
+}
+
+/*
+ * Follow mode.  An append-only NDJSON log is scanned up to its last complete
+ * line, and every later update maps and scans only the lines appended since,
+ * so the counts stay live without rescanning the file.  A file that shrinks
+ * or is replaced under its path (log rotation) is read again from its start;
+ * the counts so far are kept.
+ */
+typedef struct {
+    const char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    uint64_t done;  /* offset just past the last complete line scanned */
+} Follow;
+
+static int follow_open(Follow *f, const char *path) {
+    pthread_once(&g_key_path_once, key_path_default);
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (f->fd < 0) return 0;
+    struct stat st;
+    if (fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(f->fd);
+        f->fd = -1;
+        errno = EINVAL;
+        return 0;
+    }
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    return 1;
+}
+
+static void follow_close(Follow *f) {
+    if (f->fd >= 0) close(f->fd);
+    f->fd = -1;
+}
+
+/* Switches to the file now at the path when it is a different one.  Returns 1
+ * if it did. */
+static int follow_reopen(Follow *f) {
+    struct stat st;
+    if (stat(f->path, &st) != 0 || !S_ISREG(st.st_mode) || (st.st_dev == f->dev && st.st_ino == f->ino)) {
+        return 0;
+    }
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    follow_close(f);
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->done = 0;
+    return 1;
+}
+
+/* Scans the complete lines appended since the last update, with `threads`
+ * workers.  Returns 0 on a parse error; the lines are skipped either way. */
+static int follow_update(Follow *f, int threads, HashTable *table, uint64_t *models_seen, Progress *progress) {
+    struct stat st;
+    if (fstat(f->fd, &st) != 0) return 1;
+    uint64_t size = (uint64_t)st.st_size;
+    if (size < f->done) f->done = 0;  /* truncated in place */
+    if (size == f->done) return 1;
+
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = f->done - f->done % page;
+    Reader r;
+    memset(&r, 0, sizeof(r));
+    r.format = -1;
+    r.base_offset = start;
+    r.map_len = (size_t)(size - start);
+    r.map = mmap(NULL, r.map_len, PROT_READ, MAP_PRIVATE, f->fd, (off_t)start);
+    if (r.map == MAP_FAILED) {
+        r.map = NULL;
+        r.buf = (unsigned char *)xmalloc(r.map_len);
+        ssize_t n = pread(f->fd, r.buf, r.map_len, (off_t)start);
+        r.map_len = n > 0 ? (size_t)n : 0;
+    }
+    r.base = r.map ? (const unsigned char *)r.map : r.buf;
+    r.p = r.base + (f->done - start);
+    r.end = r.base + r.map_len;
+
+    int ok = 1;
+    const unsigned char *nl = r.p < r.end ? (const unsigned char *)memrchr(r.p, '\n', (size_t)(r.end - r.p)) : NULL;
+    if (f->done == 0 && dec_detect(r.p, (size_t)(r.end - r.p)) >= 0) {
+        fprintf(stderr, "'%s' is compressed; --follow needs plain NDJSON\n", f->path);
+        f->done = size;
+        ok = 0;
+    } else if (nl) {
+        r.end = nl + 1;
+        ok = threads > 1 ? scan_mapped_parallel(&r, threads, table, models_seen, progress)
+                         : scan_input(&r, table, models_seen, progress, NULL, NULL);
+        f->done = start + (uint64_t)(nl + 1 - r.base);
+    }
+    reader_close(&r);
+    return ok;
+}
+
+typedef struct {
+    const char *key;
+    uint64_t count;
+} Pair;
+
+/* Output order: count descending, then key. */
+static int pair_cmp(const void *a, const void *b) {
+    const Pair *pa = (const Pair *)a;
+    const Pair *pb = (const Pair *)b;
+    if (pa->count < pb->count) return 1;
+    if (pa->count > pb->count) return -1;
+    return strcmp(pa->key, pb->key);
+}
+
+/*
+ * --top N.  The first N entries in output order are selected while walking
+ * the table with a bounded heap whose root is the kept entry that sorts
+ * last, so only N entries are ever sorted.  Large tables are walked in
+ * slices by several threads, each with its own heap, and the heaps are then
+ * merged the same way.  Heaps grow with the entries pushed, so a large N
+ * costs no more than the table holds.
+ */
+#define TOP_PARALLEL_MIN 65536
+
+typedef struct {
+    Pair *items;
+    size_t len;
+    size_t cap;    /* allocated items */
+    size_t limit;  /* entries kept, N */
+} TopHeap;
+
+static void top_sift_down(TopHeap *h, size_t i) {
+    for (;;) {
+        size_t m = i;
+        size_t l = 2 * i + 1;
+        size_t r = l + 1;
+        if (l < h->len && pair_cmp(&h->items[l], &h->items[m]) > 0) m = l;
+        if (r < h->len && pair_cmp(&h->items[r], &h->items[m]) > 0) m = r;
+        if (m == i) return;
+        Pair t = h->items[i];
+        h->items[i] = h->items[m];
+        h->items[m] = t;
+        i = m;
+    }
+}
+
+static void top_push(TopHeap *h, const char *key, uint64_t count) {
+    Pair p = {key, count};
+    if (h->len < h->limit) {
+        if (h->len == h->cap) {
+            h->cap = h->cap ? 2 * h->cap : 64;
+            if (h->cap > h->limit) h->cap = h->limit;
+            Pair *tmp = (Pair *)realloc(h->items, h->cap * sizeof(Pair));
+            if (!tmp) die("Out of memory");
+            h->items = tmp;
+        }
+        size_t i = h->len++;
+        while (i > 0 && pair_cmp(&p, &h->items[(i - 1) / 2]) > 0) {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->items[i] = p;
+    } else if (count >= h->items[0].count && pair_cmp(&p, &h->items[0]) < 0) {
+        h->items[0] = p;
+        top_sift_down(h, 0);
+    }
+}
+
+static void top_entry(const EntryView *e, void *ctx) {
+    top_push((TopHeap *)ctx, e->key, e->count);
+}
+
+typedef struct {
+    const HashTable *table;
+    size_t part;
+    size_t parts;
+    TopHeap heap;
+} TopWorker;
+
+static void *top_worker(void *arg) {
+    TopWorker *w = (TopWorker *)arg;
+    table_foreach_part(w->table, w->part, w->parts, top_entry, &w->heap);
+    return NULL;
+}
+
+/* The first min(n, size) entries of table in output order, sorted, using up
+ * to `threads` threads.  *len receives their number. */
+static Pair *top_select(const HashTable *table, size_t n, int threads, size_t *len) {
+    if (n > table->size) n = table->size;
+    TopHeap heap = {(Pair *)xmalloc((n ? n : 1) * sizeof(Pair)), 0, n, n};
+    size_t parts = threads > 1 && table->size >= TOP_PARALLEL_MIN ? (size_t)threads : 1;
+    if (parts == 1 || n == 0) {
+        table_foreach(table, top_entry, &heap);
+    } else {
+        TopWorker *workers = (TopWorker *)xmalloc(parts * sizeof(TopWorker));
+        pthread_t *tids = (pthread_t *)xmalloc(parts * sizeof(pthread_t));
+        for (size_t i = 0; i < parts; ++i) {
+            workers[i].table = table;
+            workers[i].part = i;
+            workers[i].parts = parts;
+            workers[i].heap.items = NULL;
+            workers[i].heap.len = 0;
+            workers[i].heap.cap = 0;
+            workers[i].heap.limit = n;
+            if (pthread_create(&tids[i], NULL, top_worker, &workers[i]) != 0) {
+                die("Cannot create worker thread");
+            }
+        }
+        for (size_t i = 0; i < parts; ++i) {
+            pthread_join(tids[i], NULL);
+            for (size_t j = 0; j < workers[i].heap.len; ++j) {
+                top_push(&heap, workers[i].heap.items[j].key, workers[i].heap.items[j].count);
+            }
+            free(workers[i].heap.items);
+        }
+        free(tids);
+        free(workers);
+    }
+    qsort(heap.items, heap.len, sizeof(Pair), pair_cmp);
+    *len = heap.len;
+    return heap.items;
+}
+
+#ifndef MODEL_COUNT_NO_MAIN
+static size_t g_top = 0;       /* --top: entries to print, 0 for all */
+static int g_top_threads = 1;  /* threads for selecting them */
+
+
+typedef struct {
+    Pair *pairs;
+    size_t len;
+} PairList;
+
+static void collect_pair(const EntryView *e, void *ctx) {
+    PairList *list = (PairList *)ctx;
+    list->pairs[list->len].key = e->key;
+    list->pairs[list->len].count = e->count;
+    list->len++;
+}
+
+/* Parses a byte count with an optional K, M or G suffix (powers of 1024). */
+static int parse_size(const char *s, size_t *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return 0;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || v > (SIZE_MAX >> shift)) return 0;
+    *out = (size_t)(v << shift);
+    return 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j N] [--no-mmap] [--simd=auto|off|sse2|avx2|avx512]\n"
+                    "       [--table=swiss|chained] [--arena-chunk=SIZE] [--huge-pages] [--no-front-cache]\n"
+                    "       [--ndjson] [--per-file] [--checkpoint=FILE [--checkpoint-interval=SEC]\n"
+                    "       [--checkpoint-bytes=SIZE] [--resume]] [--sidecar[=FILE]]\n"
+                    "       [--index[=FILE] [--index-stride=SIZE]] [--approx[=K]] [--top=N]\n"
+                    "       [--key=PATH | --group-by=PATH,...] [--distinct=PATH] [--where=PRED]...\n"
+                    "       [--bucket-by=PATH:WIDTH] <file|dir|glob>...\n"
+                    "       %s [-j N] --follow [--follow-interval=SEC] [--snapshot=FILE] <file>\n", prog, prog);
+}
+
+/* Counts of a sketch, with bounds wherever they are not exact. */
+static void print_approx(FILE *out, const Approx *a) {
+    SSCounter *sorted = (SSCounter *)xmalloc((a->used ? a->used : 1) * sizeof(SSCounter));
+    memcpy(sorted, a->counters, a->used * sizeof(SSCounter));
+    qsort(sorted, a->used, sizeof(SSCounter), counter_cmp);
+
+    if (a->used < a->k) {
+        fprintf(out, "Unique models: %zu\n", a->used);
+    } else {
+        fprintf(out, "Unique models: ~%llu (HyperLogLog, standard error %.2f%%)\n",
+                (unsigned long long)hll_estimate(a), 100.0 * hll_error());
+        fprintf(out, "Top %zu of %llu models (Space-Saving; every model seen more than %llu times is listed)\n",
+                a->used, (unsigned long long)a->total, (unsigned long long)(a->total / a->k));
+    }
+    size_t shown = g_top && g_top < a->used ? g_top : a->used;
+    for (size_t i = 0; i < shown; ++i) {
+        const SSCounter *c = &sorted[i];
+        if (c->error) {
+            fprintf(out, "%s: %llu (at least %llu)\n", c->key, (unsigned long long)c->count,
+                    (unsigned long long)(c->count - c->error));
+        } else {
+            fprintf(out, "%s: %llu\n", c->key, (unsigned long long)c->count);
+        }
+    }
+    free(sorted);
+}
+
+/* Prints a key, unpacking --group-by tuples into "a, b". */
+static void print_key(FILE *out, const char *key) {
+    if (!g_group_len) {
+        fputs(key, out);
+        return;
+    }
+    for (const char *p = key; *p; ++p) {
+        if (*p == GROUP_SEP) {
+            fputs(", ", out);
+        } else if (*p == GROUP_NONE) {
+            fputs("(none)", out);
+        } else {
+            putc(*p, out);
+        }
+    }
+}
+
+static void print_entry(FILE *out, const HashTable *table, const Pair *p) {
+    print_key(out, p->key);
+    fprintf(out, ": %llu", (unsigned long long)p->count);
+    if (table->distinct) {
+        size_t len = strlen(p->key);
+        uint64_t n = distinct_estimate(table->distinct, p->key, len, hash_bytes(p->key, len));
+        fprintf(out, " (~%llu distinct %s)", (unsigned long long)n, g_group[g_group_keys].source);
+    }
+    putc('\n', out);
+}
+
+/* The entries to print, in output order: all of them, or the --top ones. */
+static Pair *sorted_pairs(const HashTable *table, size_t *len) {
+    if (g_top) return top_select(table, g_top, g_top_threads, len);
+    PairList list;
+    list.pairs = (Pair *)xmalloc((table->size ? table->size : 1) * sizeof(Pair));
+    list.len = 0;
+    table_foreach(table, collect_pair, &list);
+    qsort(list.pairs, list.len, sizeof(Pair), pair_cmp);
+    *len = list.len;
+    return list.pairs;
+}
+
+static void print_table(FILE *out, const HashTable *table, const char *what) {
+    size_t n;
+    Pair *pairs = sorted_pairs(table, &n);
+    fprintf(out, "Unique %s: %zu\n", what, table->size);
+    for (size_t i = 0; i < n; ++i) {
+        print_entry(out, table, &pairs[i]);
+    }
+    free(pairs);
+}
+
+static int row_cmp(const void *a, const void *b) {
+    int64_t x = (*(const SeriesRow *const *)a)->start;
+    int64_t y = (*(const SeriesRow *const *)b)->start;
+    return (x > y) - (x < y);
+}
+
+/* The --bucket-by matrix, tab separated: a row per bucket in time order and
+ * a column per printed key, in output order. */
+static void print_series(FILE *out, const HashTable *table) {
+    const Series *s = table->series;
+    size_t n;
+    Pair *pairs = sorted_pairs(table, &n);
+    uint64_t *cols = (uint64_t *)xmalloc((n ? n : 1) * sizeof(uint64_t));
+    fprintf(out, "== %s ==\nbucket", g_bucket_spec);
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(pairs[i].key);
+        const uint64_t *id = table_find(&s->ids, pairs[i].key, len, hash_bytes(pairs[i].key, len));
+        cols[i] = id ? *id : 0;
+        putc('\t', out);
+        print_key(out, pairs[i].key);
+    }
+    putc('\n', out);
+
+    const SeriesRow **rows = (const SeriesRow **)xmalloc((s->len ? s->len : 1) * sizeof(SeriesRow *));
+    for (size_t i = 0; i < s->len; ++i) {
+        rows[i] = &s->rows[i];
+    }
+    qsort(rows, s->len, sizeof(SeriesRow *), row_cmp);
+    const char *format = g_bucket_width % 86400 == 0 ? "%Y-%m-%d" : "%Y-%m-%dT%H:%M:%SZ";
+    for (size_t r = 0; r < s->len; ++r) {
+        char when[64];
+        time_t t = (time_t)rows[r]->start;
+        struct tm tm;
+        if (!gmtime_r(&t, &tm) || !strftime(when, sizeof(when), format, &tm)) {
+            snprintf(when, sizeof(when), "%lld", (long long)rows[r]->start);
+        }
+        fputs(when, out);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t c = cols[i] ? series_get(s, rows[r], cols[i] - 1) : 0;
+            fprintf(out, "\t%llu", (unsigned long long)c);
+        }
+        putc('\n', out);
+    }
+    free(rows);
+    free(cols);
+    free(pairs);
+}
+
+/* The counts; with --group-by the subtotals of every field after the
+ * counts of the tuples, and with --bucket-by the time matrix last. */
+static void print_counts(FILE *out, const HashTable *table) {
+    if (table->approx) {
+        print_approx(out, table->approx);
+        return;
+    }
+    print_table(out, table, g_group_by ? "groups" : "models");
+    if (g_group_by) {
+        HashTable sub[GROUP_MAX];
+        group_subtotals(table, sub);
+        for (size_t i = 0; i < g_group_keys; ++i) {
+            fprintf(out, "== %s ==\n", g_group[i].source);
+            print_table(out, &sub[i], "values");
+            table_free(&sub[i]);
+        }
+    }
+    if (table->series) print_series(out, table);
+}
+
+/* Writes the sorted counts to path through a temporary file and rename(), so
+ * readers never see a partial snapshot. */
+static void write_snapshot(const char *path, const HashTable *table) {
+    size_t n = strlen(path) + 5;
+    char *tmp = (char *)xmalloc(n);
+    snprintf(tmp, n, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    int ok = fp != NULL;
+    if (fp) {
+        print_counts(fp, table);
+        ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        if (fclose(fp) != 0) ok = 0;
+    }
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "Cannot write snapshot '%s': %s\n", path, strerror(errno));
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+#define FOLLOW_POLL_MS 1000
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    g_stop = 1;
+}
+
+static void emit_counts(const char *snapshot, const HashTable *table) {
+    if (snapshot) {
+        write_snapshot(snapshot, table);
+    } else {
+        print_counts(stdout, table);
+        fflush(stdout);
+    }
+}
+
+/*
+ * Keeps following f after the initial scan until SIGINT or SIGTERM, emitting
+ * the counts every `interval` seconds when they changed.  inotify wakes the
+ * loop as soon as lines are appended; the poll timeout also catches rotation
+ * and stands in for inotify where it is missing.
+ */
+static void follow_loop(Follow *f, int threads, HashTable *table, uint64_t *models_seen, double interval,
+                        const char *snapshot) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int ifd = -1;
+#ifdef __linux__
+    const uint32_t events = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int wd = ifd >= 0 ? inotify_add_watch(ifd, f->path, events) : -1;
+#endif
+
+    uint64_t emitted = *models_seen;
+    double next_emit = now_seconds() + interval;
+    while (!g_stop) {
+        double wait = (next_emit - now_seconds()) * 1000.0;
+        int timeout = wait < 0.0 ? 0 : wait > FOLLOW_POLL_MS ? FOLLOW_POLL_MS : (int)wait;
+        if (ifd >= 0) {
+            struct pollfd pfd = {ifd, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) > 0) {
+                char events_buf[4096];
+                while (read(ifd, events_buf, sizeof(events_buf)) > 0) {
+                }
+            }
+        } else {
+            usleep((useconds_t)timeout * 1000);
+        }
+        if (g_stop) break;
+
+        /* Lines written before a rotation still belong to the old file. */
+        if (!follow_update(f, threads, table, models_seen, NULL)) {
+            fprintf(stderr, "Parse error in lines appended to '%s'; skipped\n", f->path);
+        }
+        if (follow_reopen(f)) {
+#ifdef __linux__
+            if (ifd >= 0) {
+                if (wd >= 0) inotify_rm_watch(ifd, wd);
+                wd = inotify_add_watch(ifd, f->path, events);
+            }
+#endif
+            if (!follow_update(f, threads, table, models_seen, NULL)) {
+                fprintf(stderr, "Parse error in lines appended to '%s'; skipped\n", f->path);
+            }
+        }
+
+        if (now_seconds() >= next_emit) {
+            if (*models_seen != emitted) {
+                emit_counts(snapshot, table);
+                emitted = *models_seen;
+            }
+            next_emit = now_seconds() + interval;
+        }
+    }
+    if (ifd >= 0) close(ifd);
+}
+
+/* --follow: the initial scan, then updates until stopped.  The counts are
+ * emitted after the initial scan and once more on the way out. */
+static int run_follow(const Input *in, int threads, double interval, const char *snapshot) {
+    Follow f;
+    if (!follow_open(&f, in->path)) {
+        fprintf(stderr, "Cannot follow '%s': %s\n", in->path, strerror(errno));
+        return 0;
+    }
+    g_ndjson = 1;
+
+    HashTable table;
+    uint64_t models_seen = 0;
+    counts_init(&table);
+    Progress progress;
+    progress_init(&progress, (long)in->size);
+    progress_start(&progress);
+    int ok = follow_update(&f, threads, &table, &models_seen, &progress);
+    progress_stop(&progress);
+    if (ok) {
+        emit_counts(snapshot, &table);
+        follow_loop(&f, threads, &table, &models_seen, interval, snapshot);
+        emit_counts(snapshot, &table);
+    } else {
+        fprintf(stderr, "Parse error while reading '%s'\n", in->path);
+    }
+    follow_close(&f);
+    table_free(&table);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        {"no-mmap", no_argument, NULL, 'M'},
+        {"simd", required_argument, NULL, 'S'},
+        {"table", required_argument, NULL, 'T'},
+        {"arena-chunk", required_argument, NULL, 'A'},
+        {"huge-pages", no_argument, NULL, 'H'},
+        {"no-front-cache", no_argument, NULL, 'F'},
+        {"ndjson", no_argument, NULL, 'N'},
+        {"per-file", no_argument, NULL, 'P'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"checkpoint-bytes", required_argument, NULL, 'B'},
+        {"resume", no_argument, NULL, 'R'},
+        {"follow", no_argument, NULL, 'W'},
+        {"follow-interval", required_argument, NULL, 'E'},
+        {"snapshot", required_argument, NULL, 'O'},
+        {"sidecar", optional_argument, NULL, 'D'},
+        {"index", optional_argument, NULL, 'X'},
+        {"index-stride", required_argument, NULL, 'Y'},
+        {"approx", optional_argument, NULL, 'K'},
+        {"top", required_argument, NULL, 'n'},
+        {"key", required_argument, NULL, 'k'},
+        {"group-by", required_argument, NULL, 'G'},
+        {"distinct", required_argument, NULL, 'U'},
+        {"where", required_argument, NULL, 'w'},
+        {"bucket-by", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    static const char *const simd_names[] = {"off", "sse2", "avx2", "avx512", "auto"};
+
+    int threads = 1;
+    int simd = SIMD_AUTO;
+    int per_file = 0;
+    const char *ckpt_path = NULL;
+    double ckpt_interval = 300.0;
+    size_t ckpt_bytes = 0;
+    int resume = 0;
+    int follow = 0;
+    double follow_interval = 60.0;
+    const char *snapshot = NULL;
+    int sidecar = 0;
+    const char *sidecar_path = NULL;
+    int use_index = 0;
+    const char *index_path = NULL;
+    size_t index_stride = INDEX_STRIDE_DEFAULT;
+    const char *distinct_path = NULL;
+    const char *bucket_spec = NULL;
+    const char *where[WHERE_MAX];
+    size_t where_len = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'j': {
+                char *end = NULL;
+                long n = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || n < 0 || n > 4096) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                if (n == 0) {
+                    n = sysconf(_SC_NPROCESSORS_ONLN);
+                    if (n < 1) n = 1;
+                }
+                threads = (int)n;
+                break;
+            }
+            case 'M':
+                g_use_mmap = 0;
+                break;
+            case 'S':
+                simd = -1;
+                for (int i = SIMD_OFF; i <= SIMD_AUTO; ++i) {
+                    if (strcmp(optarg, simd_names[i]) == 0) simd = i;
+                }
+                if (simd < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'A':
+                if (!parse_size(optarg, &g_arena_chunk_size) || g_arena_chunk_size < 4096) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'H':
+                g_arena_huge_pages = 1;
+                break;
+            case 'F':
+                g_front_cache = 0;
+                break;
+            case 'N':
+                g_ndjson = 1;
+                break;
+            case 'P':
+                per_file = 1;
+                break;
+            case 'C':
+                ckpt_path = optarg;
+                break;
+            case 'I': {
+                char *end = NULL;
+                ckpt_interval = strtod(optarg, &end);
+                if (!end || *end != '\0' || ckpt_interval < 0.0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'B':
+                if (!parse_size(optarg, &ckpt_bytes)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'R':
+                resume = 1;
+                break;
+            case 'W':
+                follow = 1;
+                break;
+            case 'E': {
+                char *end = NULL;
+                follow_interval = strtod(optarg, &end);
+                if (!end || *end != '\0' || follow_interval <= 0.0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'O':
+                snapshot = optarg;
+                break;
+            case 'D':
+                sidecar = 1;
+                sidecar_path = optarg;
+                break;
+            case 'X':
+                use_index = 1;
+                index_path = optarg;
+                break;
+            case 'Y':
+                if (!parse_size(optarg, &index_stride) || index_stride < 4096) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n': {
+                char *end = NULL;
+                errno = 0;
+                unsigned long long n = strtoull(optarg, &end, 10);
+                if (errno || !end || *end != '\0' || n == 0 || n > SIZE_MAX / sizeof(Pair)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                g_top = (size_t)n;
+                break;
+            }
+            case 'k':
+                if (!key_path_compile(&g_key_path, optarg)) {
+                    fprintf(stderr, "Bad --key path '%s'; expected names joined by '.', each optionally "
+                                    "followed by [] (e.g. devices[].model)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'G':
+                if (!group_compile(optarg)) {
+                    fprintf(stderr, "Bad --group-by list '%s'; expected up to %d key paths joined by ','\n", optarg,
+                            GROUP_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'U':
+                distinct_path = optarg;
+                break;
+            case 'b':
+                bucket_spec = optarg;
+                break;
+            case 'w':
+                if (where_len == WHERE_MAX) {
+                    fprintf(stderr, "At most %d --where predicates are supported\n", WHERE_MAX);
+                    return EXIT_FAILURE;
+                }
+                where[where_len++] = optarg;
+                break;
+            case 'K':
+                g_approx_k = APPROX_K_DEFAULT;
+                if (optarg && (!parse_size(optarg, &g_approx_k) || g_approx_k == 0 || g_approx_k > UINT32_MAX)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'T':
+                if (strcmp(optarg, "swiss") == 0) {
+                    g_table_engine = TABLE_SWISS;
+                } else if (strcmp(optarg, "chained") == 0) {
+                    g_table_engine = TABLE_CHAINED;
+                } else {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 1 || (resume && !ckpt_path) || (snapshot && !follow)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (g_approx_k && (ckpt_path || sidecar)) {
+        fprintf(stderr, "--approx cannot be combined with --checkpoint or --sidecar\n");
+        return EXIT_FAILURE;
+    }
+    if (g_group_len && (g_key_path.len || g_approx_k || ckpt_path || sidecar)) {
+        fprintf(stderr, "--group-by cannot be combined with --key, --approx, --checkpoint or --sidecar\n");
+        group_free();
+        return EXIT_FAILURE;
+    }
+    if (distinct_path) {
+        if (g_approx_k || ckpt_path || sidecar) {
+            fprintf(stderr, "--distinct cannot be combined with --approx, --checkpoint or --sidecar\n");
+            group_free();
+            return EXIT_FAILURE;
+        }
+        if (!group_distinct(distinct_path)) {
+            fprintf(stderr, "Bad --distinct path '%s'\n", distinct_path);
+            group_free();
+            return EXIT_FAILURE;
+        }
+    }
+    if (bucket_spec) {
+        if (g_approx_k || ckpt_path || sidecar) {
+            fprintf(stderr, "--bucket-by cannot be combined with --approx, --checkpoint or --sidecar\n");
+            group_free();
+            return EXIT_FAILURE;
+        }
+        if (!group_bucket(bucket_spec)) {
+            fprintf(stderr, "Bad --bucket-by '%s'; expected PATH:WIDTH with WIDTH like 30s, 15m, 1h, 1d or 1w\n",
+                    bucket_spec);
+            group_free();
+            return EXIT_FAILURE;
+        }
+    }
+    if (where_len && (ckpt_path || sidecar)) {
+        fprintf(stderr, "--where cannot be combined with --checkpoint or --sidecar\n");
+        group_free();
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < where_len; ++i) {
+        if (!group_where(where[i])) {
+            fprintf(stderr, "Bad --where predicate '%s'; expected PATH=TEXT, PATH^=PREFIX or PATH<N, <=, >, >=\n",
+                    where[i]);
+            group_free();
+            return EXIT_FAILURE;
+        }
+    }
+    simd_select(simd);
+    g_top_threads = threads;
+    g_hash_seed ^= ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+
+    InputList inputs = {NULL, 0, 0};
+    for (int i = optind; i < argc; ++i) {
+        if (!inputs_add(&inputs, argv[i])) {
+            inputs_free(&inputs);
+            return EXIT_FAILURE;
+        }
+    }
+    if (inputs.len == 0) {
+        fprintf(stderr, "No input files\n");
+        return EXIT_FAILURE;
+    }
+
+    if (follow) {
+        if (inputs.len != 1 || per_file || ckpt_path || sidecar || use_index) {
+            fprintf(stderr, "--follow needs a single input file and no --per-file, --checkpoint, --sidecar or --index\n");
+            inputs_free(&inputs);
+            return EXIT_FAILURE;
+        }
+        int ok = run_follow(&inputs.items[0], threads, follow_interval, snapshot);
+        inputs_free(&inputs);
+        key_path_free(&g_key_path);
+        group_free();
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < inputs.len; ++i) {
+        total_bytes += inputs.items[i].size;
+    }
+
+    Checkpoint ckpt;
+    if (ckpt_path) {
+        if (inputs.len != 1 || !checkpoint_init(&ckpt, ckpt_path, inputs.items[0].path)) {
+            fprintf(stderr, "--checkpoint needs a single regular input file\n");
+            inputs_free(&inputs);
+            return EXIT_FAILURE;
+        }
+        ckpt.interval = ckpt_interval;
+        ckpt.every_bytes = ckpt_bytes;
+        if (resume) {
+            int rc = checkpoint_load(&ckpt);
+            if (rc < 0) {
+                fprintf(stderr, "Cannot use checkpoint '%s'\n", ckpt_path);
+                checkpoint_free(&ckpt);
+                inputs_free(&inputs);
+                return EXIT_FAILURE;
+            }
+            if (rc == 0) fprintf(stderr, "No checkpoint at '%s'; starting from the beginning\n", ckpt_path);
+        }
+        g_checkpoint = &ckpt;
+    }
+
+    Sidecar side;
+    if (sidecar) {
+        if (inputs.len != 1 || per_file || ckpt_path || !sidecar_init(&side, sidecar_path, inputs.items[0].path)) {
+            fprintf(stderr, "--sidecar needs a single regular input file and no --per-file or --checkpoint\n");
+            if (g_checkpoint) checkpoint_free(&ckpt);
+            inputs_free(&inputs);
+            return EXIT_FAILURE;
+        }
+    }
+
+    OffsetIndex index;
+    if (use_index) {
+        if (inputs.len != 1 || g_ndjson || !index_init(&index, index_path, inputs.items[0].path, index_stride)) {
+            fprintf(stderr, "--index needs a single regular input file and no --ndjson\n");
+            if (sidecar) sidecar_free(&side);
+            if (g_checkpoint) checkpoint_free(&ckpt);
+            inputs_free(&inputs);
+            return EXIT_FAILURE;
+        }
+        if (!index_load(&index) && threads < 2) {
+            fprintf(stderr, "The index is built by parallel scans; use -j 2 or more\n");
+        }
+        g_index = &index;
+    }
+
+    HashTable table;
+    HashTable *tables = NULL;
+    uint64_t models_seen = 0;
+    int *status = (int *)xmalloc(inputs.len * sizeof(int));
+    counts_init(&table);
+    if (per_file) {
+        tables = (HashTable *)xmalloc(inputs.len * sizeof(HashTable));
+        for (size_t i = 0; i < inputs.len; ++i) {
+            counts_init(&tables[i]);
+        }
+    }
+
+    int ok;
+    if (sidecar && sidecar_load(&side, &table, &models_seen)) {
+        status[0] = 1;
+        ok = 1;
+    } else {
+        if (sidecar) g_sidecar = &side;
+        Progress progress;
+        progress_init(&progress, (long)total_bytes);
+        progress_start(&progress);
+        ok = process_files(&inputs, threads, &table, &models_seen, &progress, tables, status);
+        progress_stop(&progress);
+        if (ok && g_sidecar) sidecar_write(g_sidecar);
+        g_sidecar = NULL;
+    }
+    if (g_index) {
+        if (ok && g_index->built) index_write(g_index);
+        index_free(g_index);
+        g_index = NULL;
+    }
+
+    for (size_t i = 0; i < inputs.len; ++i) {
+        if (status[i] < 0) {
+            fprintf(stderr, "Cannot open '%s': %s\n", inputs.items[i].path, strerror(-status[i]));
+        } else if (status[i] == 0) {
+            fprintf(stderr, "Parse error while reading '%s'\n", inputs.items[i].path);
+        }
+    }
+
+    if (ok) {
+        if (per_file) {
+            for (size_t i = 0; i < inputs.len; ++i) {
+                printf("== %s ==\n", inputs.items[i].path);
+                print_counts(stdout, &tables[i]);
+            }
+            printf("== total ==\n");
+        }
+        print_counts(stdout, &table);
+    }
+
+    if (tables) {
+        for (size_t i = 0; i < inputs.len; ++i) {
+            table_free(&tables[i]);
+        }
+        free(tables);
+    }
+    if (g_checkpoint) {
+        /* A finished scan needs no restart point. */
+        if (ok) remove(ckpt_path);
+        checkpoint_free(&ckpt);
+        g_checkpoint = NULL;
+    }
+    if (sidecar) sidecar_free(&side);
+    free(status);
+    inputs_free(&inputs);
     table_free(&table);
-    return EXIT_SUCCESS;
+    key_path_free(&g_key_path);
+    group_free();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 #endif
@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,12 +10,18 @@
 #define MODEL_COUNT_NO_MAIN
 #include "../model_count.c"
 
+static int test_threads = 1;
+
 static uint64_t get_count(const HashTable *table, const char *model) {
-    uint64_t h = hash_str(model);
+    if (table->engine == TABLE_SWISS) {
+        const Slot *s = swiss_find(table, model, strlen(model), hash_bytes(model, strlen(model)));
+        return s ? s->count : 0;
+    }
+    uint64_t h = hash_bytes(model, strlen(model));
     size_t idx = (size_t)(h % table->bucket_count);
     const Entry *e = table->buckets[idx];
     while (e) {
-        if (strcmp(e->key, model) == 0) {
+        if (strcmp(entry_key(e), model) == 0) {
             return e->count;
         }
         e = e->next;
@@ -19,6 +29,29 @@ static uint64_t get_count(const HashTable *table, const char *model) {
     return 0;
 }
 
+typedef struct {
+    const HashTable *other;
+    int equal;
+} CompareCtx;
+
+static void compare_entry(const EntryView *e, void *ctx) {
+    CompareCtx *c = (CompareCtx *)ctx;
+    if (get_count(c->other, e->key) != e->count) c->equal = 0;
+}
+
+static void inc(HashTable *table, const char *key) {
+    size_t len = strlen(key);
+    table_add(table, key, len, hash_bytes(key, len), 1);
+}
+
+/* Every entry of a is in b with the same count, and the sizes match. */
+static int tables_equal(const HashTable *a, const HashTable *b) {
+    if (a->size != b->size) return 0;
+    CompareCtx ctx = {b, 1};
+    table_foreach(a, compare_entry, &ctx);
+    return ctx.equal;
+}
+
 static void write_or_die(FILE *fp, const char *text) {
     if (fputs(text, fp) == EOF) {
         fprintf(stderr, "Failed to write test input\n");
@@ -46,19 +79,31 @@ static void expect_counts(const char *json,
 
     HashTable table;
     uint64_t models_seen = 0;
-    ProgressState progress = {0};
-    progress.start_time = now_seconds();
-    progress.last_time = progress.start_time;
-    progress.last_models_seen = 0;
+    Progress progress;
+    progress_init(&progress, (long)strlen(json));
     table_init(&table, INITIAL_BUCKETS);
 
-    if (!process_file(fp, &table, &models_seen, &progress, (long)strlen(json))) {
+    /* The reporter runs alongside but stays quiet within its interval. */
+    progress_start(&progress);
+    int ok = test_threads > 1
+        ? process_file_parallel(fp, &table, &models_seen, &progress, test_threads)
+        : process_file(fp, &table, &models_seen, &progress);
+    progress_stop(&progress);
+    if (!ok) {
         fprintf(stderr, "process_file() failed for input: %s\n", json);
         table_free(&table);
         fclose(fp);
         exit(1);
     }
 
+    /* Every byte and model is published by the end of the scan. */
+    if (atomic_load(&progress.models) != models_seen || atomic_load(&progress.bytes) != strlen(json)) {
+        fprintf(stderr, "Progress totals are off for input: %s\n", json);
+        table_free(&table);
+        fclose(fp);
+        exit(1);
+    }
+
     if (table.size != expected_unique) {
         fprintf(stderr, "Expected %zu unique models, got %zu\n", expected_unique, table.size);
         table_free(&table);
@@ -94,7 +139,7 @@ static void expect_counts(const char *json,
     fclose(fp);
 }
 
-int main(void) {
+static void run_cases(void) {
     expect_counts(
         "[{\"id\":1,\"model\":\"RDV2\",\"serial\":\"A\"},"
         "{\"id\":2,\"model\":\"ABC\",\"serial\":\"B\"},"
@@ -111,6 +156,1457 @@ int main(void) {
         "[{\"model\":\"RDV2\"},{\"model\":123},{\"model\":\"RDV2\"},{\"model\":\"ABC\"}]",
         2, 2, 1, 0);
 
+    expect_counts(
+        "[{\"note\":\"a \\\"},{\\\" b\",\"model\":\"RDV2\"},\n"
+        "{\"model\":\"ABC\",\"x\":\"\\\\\"},{\"model\":\"XYZ\",\"y\":[1,{\"z\":\",\"}]}]",
+        3, 1, 1, 1);
+
+    expect_counts(
+        "{\"model\":\"RDV2\"}\n{\"model\":\"RDV2\",\"n\":\"\\n,\"}\n{\"model\":\"XYZ\"}\n",
+        2, 2, 0, 1);
+
+    /* Keys that share a prefix with "model" or only decode to something
+     * close to it must not match. */
+    expect_counts(
+        "[{\"mode\":\"ABC\",\"modelx\":\"ABC\",\"mod\\u0065l\":\"ABC\",\"a\\\"model\":\"ABC\","
+        "\"model\":\"XYZ\"},{\"model\" : \"RDV2\"}]",
+        2, 1, 0, 1);
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static unsigned rng(unsigned n) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state % n);
+}
+
+static void gen_string(FILE *fp) {
+    static const char *const pieces[] = {
+        "a", "model", "{", "}", "[", "]", ",", ":", " ", "\\\"", "\\\\", "\\\\\\\"",
+        "\\n", "\\u0041", "xyzxyzxyzxyzxyzxyzxyzxyzxyzxyzxyzxyzxyz",
+    };
+    fputc('"', fp);
+    unsigned n = rng(12);
+    for (unsigned i = 0; i < n; ++i) {
+        fputs(pieces[rng(sizeof(pieces) / sizeof(pieces[0]))], fp);
+    }
+    fputc('"', fp);
+}
+
+static void gen_value(FILE *fp, int depth) {
+    switch (depth > 3 ? rng(3) : rng(5)) {
+        case 0: gen_string(fp); break;
+        case 1: fprintf(fp, "%u", rng(100000)); break;
+        case 2: fputs(rng(2) ? "true" : "null", fp); break;
+        case 3: {
+            fputc('[', fp);
+            unsigned n = rng(4);
+            for (unsigned i = 0; i < n; ++i) {
+                if (i) fputs(", ", fp);
+                gen_value(fp, depth + 1);
+            }
+            fputc(']', fp);
+            break;
+        }
+        default: {
+            fputc('{', fp);
+            unsigned n = rng(4);
+            for (unsigned i = 0; i < n; ++i) {
+                if (i) fputc(',', fp);
+                if (rng(3) == 0) fputs("\"model\"", fp); else gen_string(fp);
+                fputs(rng(2) ? ":" : " : ", fp);
+                gen_value(fp, depth + 1);
+            }
+            fputc('}', fp);
+            break;
+        }
+    }
+}
+
+/* Writes a random array of records with escapes, nested containers and
+ * strings longer than a 64-byte block, or one record per line. */
+static FILE *gen_records(unsigned records, int ndjson) {
+    static const char *const models[] = {"RDV2", "ABC", "XYZ", "a\\\"b", "c\\\\", "HGST2048T"};
+    FILE *fp = tmpfile();
+    if (!fp) {
+        fprintf(stderr, "tmpfile() failed\n");
+        exit(1);
+    }
+    if (!ndjson) fputc('[', fp);
+    for (unsigned r = 0; r < records; ++r) {
+        if (r) fputs(ndjson ? "\n" : rng(2) ? ",\n" : ",", fp);
+        fputs("{\"id\":", fp);
+        gen_value(fp, 1);
+        fprintf(fp, ",\"model\":\"%s\",\"extra\":", models[rng(sizeof(models) / sizeof(models[0]))]);
+        gen_value(fp, 1);
+        fputc('}', fp);
+    }
+    fputs(ndjson ? "\n" : "]\n", fp);
+    if (fflush(fp) != 0) {
+        fprintf(stderr, "Failed to write test input\n");
+        exit(1);
+    }
+    return fp;
+}
+
+static void scan_generated(FILE *fp, int threads, HashTable *table) {
+    uint64_t models_seen = 0;
+    table_init(table, INITIAL_BUCKETS);
+    if (fseek(fp, 0, SEEK_SET) != 0 ||
+        !process_file_parallel(fp, table, &models_seen, NULL, threads)) {
+        fprintf(stderr, "process_file_parallel() failed on generated input\n");
+        exit(1);
+    }
+}
+
+/* The vectorized scanners must build exactly the tables the scalar reference
+ * builds, whatever the block alignment, window size or chunking. */
+static void expect_simd_matches_scalar(void) {
+    for (int round = 0; round < 20; ++round) {
+        FILE *fp = gen_records(50 + rng(400), 0);
+
+        HashTable ref;
+        simd_select(SIMD_OFF);
+        scan_generated(fp, 1, &ref);
+
+        for (int level = SIMD_SSE2; level <= SIMD_AVX512; ++level) {
+            if (simd_select(level) != level) continue;
+            for (int mode = 0; mode < 3; ++mode) {
+                HashTable table;
+                g_use_mmap = mode != 1;
+                g_chunk_size = mode == 2 ? 97 : CHUNK_SIZE_DEFAULT;
+                scan_generated(fp, mode == 2 ? 3 : 1, &table);
+                if (!tables_equal(&ref, &table)) {
+                    fprintf(stderr, "SIMD level %d (mode %d) disagrees with the scalar scan\n", level, mode);
+                    exit(1);
+                }
+                table_free(&table);
+            }
+        }
+        g_use_mmap = 1;
+        g_chunk_size = CHUNK_SIZE_DEFAULT;
+
+        table_free(&ref);
+        fclose(fp);
+    }
+    simd_select(SIMD_OFF);
+}
+
+static unsigned char *read_all(FILE *fp, size_t *len) {
+    if (fseek(fp, 0, SEEK_END) != 0) exit(1);
+    *len = (size_t)ftell(fp);
+    unsigned char *data = (unsigned char *)xmalloc(*len);
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(data, 1, *len, fp) != *len) {
+        fprintf(stderr, "Failed to read back test input\n");
+        exit(1);
+    }
+    return data;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Compresses data as `parts` gzip members or zstd frames cut at arbitrary
+ * bytes, dropping the last `cut` bytes of the result.  zstd output also gets
+ * a skippable frame, as in the seekable format. */
+static FILE *compress_input(const unsigned char *data, size_t len, int format, size_t parts, size_t cut) {
+    size_t cap = len + 64 * parts + 4096;
+    unsigned char *out = (unsigned char *)xmalloc(cap);
+    size_t out_len = 0;
+    for (size_t i = 0; i < parts; ++i) {
+        const unsigned char *part = data + len * i / parts;
+        size_t part_len = len * (i + 1) / parts - len * i / parts;
+#ifdef HAVE_ZLIB
+        if (format == DEC_GZIP) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) exit(1);
+            zs.next_in = (Bytef *)(uintptr_t)part;
+            zs.avail_in = (uInt)part_len;
+            zs.next_out = out + out_len;
+            zs.avail_out = (uInt)(cap - out_len);
+            if (deflate(&zs, Z_FINISH) != Z_STREAM_END) exit(1);
+            out_len = cap - zs.avail_out;
+            deflateEnd(&zs);
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (format == DEC_ZSTD) {
+            size_t n = ZSTD_compress(out + out_len, cap - out_len, part, part_len, 3);
+            if (ZSTD_isError(n)) exit(1);
+            out_len += n;
+            if (i == parts / 2) {
+                static const unsigned char skippable[] = {0x5e, 0x2a, 0x4d, 0x18, 4, 0, 0, 0, 1, 2, 3, 4};
+                memcpy(out + out_len, skippable, sizeof(skippable));
+                out_len += sizeof(skippable);
+            }
+        }
+#endif
+    }
+
+    FILE *fp = tmpfile();
+    if (!fp || fwrite(out, 1, out_len - cut, fp) != out_len - cut || fflush(fp) != 0) {
+        fprintf(stderr, "Failed to write compressed test input\n");
+        exit(1);
+    }
+    free(out);
+    return fp;
+}
+
+/* Decompressed input must count exactly like the plain file, mapped or
+ * streamed, serially or frame-parallel, and truncated input must fail. */
+static void expect_compressed_matches_plain(int format, unsigned records, size_t parts) {
+    FILE *plain = gen_records(records, rng(2));
+    size_t len;
+    unsigned char *data = read_all(plain, &len);
+
+    HashTable ref;
+    scan_generated(plain, 1, &ref);
+
+    FILE *fp = compress_input(data, len, format, parts, 0);
+    for (int mode = 0; mode < 3; ++mode) {
+        HashTable table;
+        g_use_mmap = mode != 1;
+        scan_generated(fp, mode == 2 ? 1 : 3, &table);
+        if (!tables_equal(&ref, &table) || !tables_equal(&table, &ref)) {
+            fprintf(stderr, "Compressed input (format %d, mode %d) disagrees with the plain scan\n", format, mode);
+            exit(1);
+        }
+        table_free(&table);
+    }
+    g_use_mmap = 1;
+    fclose(fp);
+
+    fp = compress_input(data, len, format, parts, 7);
+    HashTable table;
+    uint64_t models_seen = 0;
+    table_init(&table, INITIAL_BUCKETS);
+    if (fseek(fp, 0, SEEK_SET) != 0 || process_file_parallel(fp, &table, &models_seen, NULL, 3)) {
+        fprintf(stderr, "Truncated compressed input (format %d) was accepted\n", format);
+        exit(1);
+    }
+    table_free(&table);
+    fclose(fp);
+
+    table_free(&ref);
+    free(data);
+    fclose(plain);
+}
+#endif
+
+static void write_file(const char *path, FILE *src) {
+    size_t len;
+    unsigned char *data = read_all(src, &len);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(data, 1, len, fp) != len || fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        exit(1);
+    }
+    free(data);
+}
+
+/* A directory tree of inputs must count like the inputs one by one, with
+ * per-file tables matching each input, whatever the pool size. */
+static void expect_files_merge(void) {
+    static const char *const names[] = {"b.json", "a.json", "sub/c.json", "sub/deeper/d.json", "e.ndjson"};
+    enum { FILES = sizeof(names) / sizeof(names[0]) };
+    char dir[] = "/tmp/model_count_testXXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "mkdtemp() failed\n");
+        exit(1);
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/sub/deeper", dir);
+    mkdir(path, 0700);
+
+    HashTable refs[FILES];
+    HashTable total;
+    table_init(&total, 16);
+    for (int i = 0; i < FILES; ++i) {
+        FILE *fp = gen_records(10 + rng(2000), i == 4);
+        scan_generated(fp, 1, &refs[i]);
+        table_merge(&total, &refs[i]);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        write_file(path, fp);
+        fclose(fp);
+    }
+
+    /* Directory order is by name: a, b, e, sub/c, sub/deeper/d. */
+    static const int by_name[] = {1, 0, 4, 2, 3};
+    for (int threads = 1; threads <= 4; threads += 3) {
+        InputList inputs = {NULL, 0, 0};
+        if (!inputs_add(&inputs, dir) || inputs.len != FILES) {
+            fprintf(stderr, "Directory expansion found %zu files\n", inputs.len);
+            exit(1);
+        }
+        HashTable table;
+        HashTable per_file[FILES];
+        int status[FILES];
+        uint64_t models_seen = 0;
+        table_init(&table, 16);
+        for (int i = 0; i < FILES; ++i) table_init(&per_file[i], 16);
+        if (!process_files(&inputs, threads, &table, &models_seen, NULL, per_file, status) ||
+            !tables_equal(&table, &total) || !tables_equal(&total, &table)) {
+            fprintf(stderr, "Merged multi-file counts are wrong with %d threads\n", threads);
+            exit(1);
+        }
+        for (int i = 0; i < FILES; ++i) {
+            if (!tables_equal(&per_file[i], &refs[by_name[i]]) || !tables_equal(&refs[by_name[i]], &per_file[i])) {
+                fprintf(stderr, "Per-file counts for %s are wrong\n", inputs.items[i].path);
+                exit(1);
+            }
+            table_free(&per_file[i]);
+        }
+        table_free(&table);
+        inputs_free(&inputs);
+    }
+
+    /* A glob takes only what it matches. */
+    InputList inputs = {NULL, 0, 0};
+    snprintf(path, sizeof(path), "%s/*.json", dir);
+    if (!inputs_add(&inputs, path) || inputs.len != 2) {
+        fprintf(stderr, "Glob expansion found %zu files\n", inputs.len);
+        exit(1);
+    }
+    inputs_free(&inputs);
+    snprintf(path, sizeof(path), "%s/*.none", dir);
+    if (inputs_add(&inputs, path)) {
+        fprintf(stderr, "An empty glob was accepted\n");
+        exit(1);
+    }
+    inputs_free(&inputs);
+
+    for (int i = FILES - 1; i >= 0; --i) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        remove(path);
+        table_free(&refs[i]);
+    }
+    snprintf(path, sizeof(path), "%s/sub/deeper", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    rmdir(path);
+    rmdir(dir);
+    table_free(&total);
+}
+
+/* --key paths descend only into their own members and array elements, the
+ * same serially and in parallel; malformed paths are refused. */
+static void expect_key_paths(void) {
+    static const char *const json =
+        "[{\"model\":\"top\",\"disk\":{\"model\":\"D1\",\"x\":{\"model\":\"no\"}},"
+        "\"devices\":[{\"model\":\"A\"},{\"model\":\"B\",\"n\":[{\"model\":\"no\"}]},3,\"s\",{}]},\n"
+        " {\"disk\":\"str\",\"devices\":{\"model\":\"no\"},\"grid\":[[{\"m\":\"G1\"}],[],[{\"m\":\"G2\"},null]]},\n"
+        " {\"disk\":{ \"vendor\" : [1,{}], \"model\" : \"D\\/2\" },\"devices\":[ ],\"model\":\"top\"}]\n";
+    static const struct {
+        const char *path;
+        size_t unique;
+        const char *key;
+        uint64_t count;
+    } cases[] = {
+        {"model", 1, "top", 2},
+        {"disk.model", 2, "D/2", 1},
+        {"[].disk.model", 2, "D1", 1},
+        {"devices[].model", 2, "B", 1},
+        {"grid[][].m", 2, "G2", 1},
+        {"disk", 1, "str", 1},
+        {"disk.model.x", 0, "D1", 0},
+    };
+    static const char *const bad[] = {"", "[]", ".model", "model.", "a..b", "a[", "a[]b", "a]"};
+
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, json);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if (!key_path_compile(&g_key_path, cases[i].path)) {
+            fprintf(stderr, "Key path '%s' was refused\n", cases[i].path);
+            exit(1);
+        }
+        for (int threads = 1; threads <= 3; threads += 2) {
+            HashTable table;
+            g_chunk_size = 97;
+            scan_generated(fp, threads, &table);
+            if (table.size != cases[i].unique || get_count(&table, cases[i].key) != cases[i].count ||
+                get_count(&table, "no") != 0) {
+                fprintf(stderr, "Key path '%s' with %d threads counted wrongly\n", cases[i].path, threads);
+                exit(1);
+            }
+            table_free(&table);
+        }
+    }
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        if (key_path_compile(&g_key_path, bad[i])) {
+            fprintf(stderr, "Malformed key path '%s' was accepted\n", bad[i]);
+            exit(1);
+        }
+    }
+    key_path_compile(&g_key_path, KEY_MODEL);
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    fclose(fp);
+}
+
+/* --group-by counts one packed tuple per record, with (none) for missing or
+ * non-string fields, and its subtotals are the per-field counts. */
+static void expect_group_by(void) {
+    static const char *const json =
+        "[{\"model\":\"A\",\"fw\":\"1.0\",\"disk\":{\"vendor\":\"X\",\"fw\":\"no\"}},\n"
+        " {\"fw\":\"1.1\",\"model\":\"A\",\"disk\":{\"vendor\":\"Y\"},\"model\":\"late\"},\n"
+        " {\"model\":\"B\",\"fw\":\"1.0\",\"tags\":[{\"fw\":\"no\"}],\"disk\":[]},\n"
+        " {\"model\":\"A\",\"fw\":\"1.0\"}, {\"fw\":7,\"model\":\"C\"}, {}]\n";
+    static const struct {
+        const char *key;
+        uint64_t count;
+    } groups[] = {
+        {"A\x1f" "1.0\x1f" "X", 1}, {"A\x1f" "1.1\x1f" "Y", 1}, {"B\x1f" "1.0\x1f\x1e", 1},
+        {"A\x1f" "1.0\x1f\x1e", 1}, {"C\x1f\x1e\x1f\x1e", 1},   {"\x1e\x1f\x1e\x1f\x1e", 1},
+    };
+
+    if (group_compile("model,,fw") || group_compile("") || group_compile("a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p,q") ||
+        !group_compile("model,fw,disk.vendor")) {
+        fprintf(stderr, "group_compile() accepted or refused the wrong lists\n");
+        exit(1);
+    }
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, json);
+    for (int threads = 1; threads <= 3; threads += 2) {
+        HashTable table;
+        g_chunk_size = 61;
+        scan_generated(fp, threads, &table);
+        int ok = table.size == sizeof(groups) / sizeof(groups[0]);
+        for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i) {
+            ok = ok && get_count(&table, groups[i].key) == groups[i].count;
+        }
+        HashTable sub[3];
+        group_subtotals(&table, sub);
+        ok = ok && sub[0].size == 4 && get_count(&sub[0], "A") == 3 && get_count(&sub[0], "\x1e") == 1 &&
+             sub[1].size == 3 && get_count(&sub[1], "1.0") == 3 && get_count(&sub[1], "\x1e") == 2 &&
+             sub[2].size == 3 && get_count(&sub[2], "\x1e") == 4;
+        if (!ok) {
+            fprintf(stderr, "--group-by with %d threads counted wrongly\n", threads);
+            exit(1);
+        }
+        for (int i = 0; i < 3; ++i) {
+            table_free(&sub[i]);
+        }
+        table_free(&table);
+    }
+    group_free();
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    fclose(fp);
+}
+
+static uint64_t distinct_of(const HashTable *table, const char *key) {
+    return distinct_estimate(table->distinct, key, strlen(key), hash_bytes(key, strlen(key)));
+}
+
+/* --distinct estimates stay within a few standard errors, sparse and dense
+ * sketches alike, and merging makes them independent of how the input was
+ * split: per-thread sketches and per-field subtotals union to the same
+ * registers. */
+static void expect_distinct_counts(void) {
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    static const struct {
+        const char *model;
+        int serials;
+        int repeats;
+    } models[] = {{"A", 50, 3}, {"B", 3000, 2}, {"C", 1, 7}};
+    char line[128];
+    write_or_die(fp, "[");
+    for (size_t m = 0; m < sizeof(models) / sizeof(models[0]); ++m) {
+        for (int k = 0; k < models[m].repeats; ++k) {
+            for (int i = 0; i < models[m].serials; ++i) {
+                snprintf(line, sizeof(line), "{\"model\":\"%s\",\"fw\":\"F%d\",\"serial\":\"S%d\"},\n",
+                         models[m].model, i % 2, i);
+                write_or_die(fp, line);
+            }
+        }
+    }
+    write_or_die(fp, "{\"model\":\"A\"},{\"serial\":\"S1\"}]\n");
+
+    uint64_t serial_est[3] = {0, 0, 0};
+    for (int pass = 0; pass < 3; ++pass) {
+        if (pass < 2 ? !group_distinct("serial") : !(group_compile("model,fw") && group_distinct("serial"))) {
+            fprintf(stderr, "group_distinct() refused a valid path\n");
+            exit(1);
+        }
+        int threads = pass == 1 ? 3 : 1;
+        HashTable table;
+        uint64_t models_seen = 0;
+        g_chunk_size = 4096;
+        counts_init(&table);
+        if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads)) {
+            fprintf(stderr, "process_file_parallel() failed with --distinct\n");
+            exit(1);
+        }
+        int ok = 1;
+        if (pass < 2) {
+            ok = table.size == 3 && get_count(&table, "A") == 151 && get_count(&table, "B") == 6000;
+            for (size_t m = 0; m < 3; ++m) {
+                uint64_t est = distinct_of(&table, models[m].model);
+                double err = fabs((double)est - models[m].serials) / models[m].serials;
+                ok = ok && err < 0.05;
+                if (pass == 0) serial_est[m] = est;
+                ok = ok && est == serial_est[m];
+            }
+        } else {
+            HashTable sub[2];
+            group_subtotals(&table, sub);
+            for (size_t m = 0; m < 3; ++m) {
+                ok = ok && distinct_of(&sub[0], models[m].model) == serial_est[m];
+            }
+            ok = ok && get_count(&sub[0], "\x1e") == 1;
+            table_free(&sub[0]);
+            table_free(&sub[1]);
+        }
+        if (!ok) {
+            fprintf(stderr, "--distinct pass %d estimated wrongly\n", pass);
+            exit(1);
+        }
+        table_free(&table);
+        group_free();
+    }
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    fclose(fp);
+}
+
+/* Without --group-by, --distinct leaves the --key counts as the plain scan
+ * makes them, every value on a "[]" path included, and each value takes the
+ * --distinct value of its own array element, or else of its record. */
+static void expect_distinct_keeps_key_counts(void) {
+    static const char *const json =
+        "[{\"host\":\"h1\",\"devices\":[{\"model\":\"A\",\"serial\":\"1\"},{\"serial\":\"2\",\"model\":\"B\"},\n"
+        "   {\"model\":\"A\",\"serial\":\"3\"},{\"model\":\"C\"}]},\n"
+        " {\"devices\":[{\"model\":\"A\",\"serial\":\"4\"},{\"model\":\"A\",\"serial\":\"4\"}],\"host\":\"h2\"},\n"
+        " {\"host\":\"h1\",\"devices\":[]}]\n";
+    static const struct {
+        const char *path;
+        uint64_t a, b, c;
+    } cases[] = {{"devices[].serial", 3, 1, 0}, {"host", 2, 1, 1}};
+
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, json);
+    key_path_compile(&g_key_path, "devices[].model");
+    HashTable ref;
+    scan_generated(fp, 1, &ref);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        for (int threads = 1; threads <= 3; threads += 2) {
+            if (!group_distinct(cases[i].path)) {
+                fprintf(stderr, "group_distinct() refused '%s'\n", cases[i].path);
+                exit(1);
+            }
+            HashTable table;
+            uint64_t models_seen = 0;
+            g_chunk_size = 37;
+            counts_init(&table);
+            if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads) ||
+                !tables_equal(&ref, &table) || !tables_equal(&table, &ref) || get_count(&table, "A") != 4 ||
+                distinct_of(&table, "A") != cases[i].a || distinct_of(&table, "B") != cases[i].b ||
+                distinct_of(&table, "C") != cases[i].c) {
+                fprintf(stderr, "--distinct=%s with %d threads changed the counts\n", cases[i].path, threads);
+                exit(1);
+            }
+            table_free(&table);
+            group_free();
+        }
+    }
+    key_path_compile(&g_key_path, KEY_MODEL);
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    table_free(&ref);
+    fclose(fp);
+}
+
+/* --where predicates decide at the closing brace whether a record counts,
+ * on strings as decoded and on other scalars as written; one that always
+ * holds leaves the counts of a "[]" key path as they were. */
+static void expect_where_filters(void) {
+    static const char *const json =
+        "[{\"model\":\"A\",\"status\":\"active\",\"id\":5,\"cluster\":\"eu-1\"},\n"
+        " {\"status\":\"retired\",\"model\":\"A\",\"id\":-2.5e1,\"cluster\":\"us-2\"},\n"
+        " {\"model\":\"B\",\"status\":\"act\\u0069ve\",\"id\":\"7\",\"ok\":true,\"tags\":[\"x\",\"eu-9\"]},\n"
+        " {\"model\":\"B\",\"status\":\"active\",\"id\":12,\"ok\":false,\"tags\":[\"eu-3\"]},\n"
+        " {\"model\":\"C\",\"id\":null,\"nested\":{\"status\":\"active\"},\"cluster\":\"eu-1\"},\n"
+        " {\"status\":\"active\",\"id\":1}]\n";
+    static const struct {
+        const char *where[3];
+        size_t unique;
+        uint64_t a, b, c;
+    } cases[] = {
+        {{"status=active", NULL, NULL}, 2, 1, 1, 0},
+        {{"cluster^=eu-", NULL, NULL}, 2, 1, 0, 1},
+        {{"id>=5", "id<=12", NULL}, 2, 1, 1, 0},
+        {{"id<0", NULL, NULL}, 1, 1, 0, 0},
+        {{"id>6", "ok=false", NULL}, 1, 0, 1, 0},
+        {{"id=null", "nested.status=active", NULL}, 1, 0, 0, 1},
+        {{"tags[]^=eu-", "status^=act", NULL}, 1, 0, 2, 0},
+        {{"status=active", "cluster=eu-1", "id>100"}, 0, 0, 0, 0},
+    };
+    static const char *const bad[] = {"status", "=x", "id<x", "id>", "a..b=1"};
+
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, json);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        for (int threads = 1; threads <= 3; threads += 2) {
+            for (int j = 0; j < 3 && cases[i].where[j]; ++j) {
+                if (!group_where(cases[i].where[j])) {
+                    fprintf(stderr, "Predicate '%s' was refused\n", cases[i].where[j]);
+                    exit(1);
+                }
+            }
+            HashTable table;
+            g_chunk_size = 53;
+            scan_generated(fp, threads, &table);
+            if (table.size != cases[i].unique || get_count(&table, "A") != cases[i].a ||
+                get_count(&table, "B") != cases[i].b || get_count(&table, "C") != cases[i].c) {
+                fprintf(stderr, "Predicates of case %zu with %d threads counted wrongly\n", i, threads);
+                exit(1);
+            }
+            table_free(&table);
+            group_free();
+        }
+    }
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+        if (group_where(bad[i])) {
+            fprintf(stderr, "Malformed predicate '%s' was accepted\n", bad[i]);
+            exit(1);
+        }
+        group_free();
+    }
+    fclose(fp);
+
+    fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, "[{\"devices\":[{\"model\":\"A\",\"serial\":\"1\"},{\"model\":\"B\",\"serial\":\"2\"},"
+                     "{\"model\":\"A\",\"serial\":\"3\"}]},\n {\"devices\":[{\"model\":\"A\",\"serial\":\"4\"}]}]\n");
+    key_path_compile(&g_key_path, "devices[].model");
+    HashTable ref;
+    scan_generated(fp, 1, &ref);
+    for (int threads = 1; threads <= 3; threads += 2) {
+        HashTable table;
+        if (!group_where("devices[].serial^=")) exit(1);
+        scan_generated(fp, threads, &table);
+        if (!tables_equal(&ref, &table) || !tables_equal(&table, &ref) || get_count(&table, "A") != 3 ||
+            get_count(&table, "B") != 1) {
+            fprintf(stderr, "A predicate that always holds changed the counts with %d threads\n", threads);
+            exit(1);
+        }
+        table_free(&table);
+        group_free();
+    }
+    key_path_compile(&g_key_path, KEY_MODEL);
+    table_free(&ref);
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    fclose(fp);
+}
+
+static uint64_t bucket_count(const HashTable *table, const char *key, int64_t start) {
+    const Series *s = table->series;
+    char k[sizeof(start)];
+    memcpy(k, &start, sizeof(k));
+    const uint64_t *id = table_find(&s->ids, key, strlen(key), hash_bytes(key, strlen(key)));
+    const uint64_t *row = table_find(&s->starts, k, sizeof(k), hash_bytes(k, sizeof(k)));
+    return id && row ? series_get(s, &s->rows[*row - 1], *id - 1) : 0;
+}
+
+/* Timestamps parse at fixed positions, and --bucket-by splits each key's
+ * count over its buckets, however the scan was split, every value of a
+ * "[]" key path included. */
+static void expect_bucket_by(void) {
+    static const struct {
+        const char *text;
+        int64_t t;  /* INT64_MIN when invalid */
+    } stamps[] = {
+        {"2024-05-04T15:30:00Z", 1714836600},
+        {"2024-05-04 15:30:00.123456+02:00", 1714836600 - 7200},
+        {"2024-05-04T15:30-0530", 1714836600 + 19800},
+        {"2024-05-04", 1714780800},
+        {"1969-12-31T23:59:59Z", -1},
+        {"2000-02-29T12:00:00z", 951825600},
+        {"1714836600", 1714836600},
+        {"1714836600123", 1714836600},
+        {"-1.5", -2},
+        {"2024-02-29", 1709164800},
+        {"2024-05-04T24:00:00Z", 1714867200},
+        {"2024-05-04T24:00", 1714867200},
+        {"2024-05-04T24:00:00.000", 1714867200},
+        {"2024-02-31", INT64_MIN},
+        {"2023-02-29", INT64_MIN},
+        {"1900-02-29T00:00:00Z", INT64_MIN},
+        {"2024-04-31T00:00:00Z", INT64_MIN},
+        {"2024-05-04T24:59", INT64_MIN},
+        {"2024-05-04T24:00:01Z", INT64_MIN},
+        {"2024-05-04T24:00:00.5Z", INT64_MIN},
+        {"2024-05-04T10:00+24:00", INT64_MIN},
+        {"2024-13-01", INT64_MIN},
+        {"2024-05-04T15", INT64_MIN},
+        {"2024-05-04T15:30:00Zjunk", INT64_MIN},
+        {"04/05/2024", INT64_MIN},
+        {"", INT64_MIN},
+    };
+    for (size_t i = 0; i < sizeof(stamps) / sizeof(stamps[0]); ++i) {
+        int64_t t = INT64_MIN;
+        int ok = parse_timestamp(stamps[i].text, strlen(stamps[i].text), &t);
+        if (ok != (stamps[i].t != INT64_MIN) || (ok && t != stamps[i].t)) {
+            fprintf(stderr, "Timestamp '%s' parsed wrongly\n", stamps[i].text);
+            exit(1);
+        }
+    }
+    if (group_bucket("ts") || group_bucket("ts:0h") || group_bucket(":1h") || group_bucket("ts:1y") ||
+        !group_bucket("ts:1w") || bucket_start(1714836600) != 1714348800 || bucket_start(-1) != -3 * 86400) {
+        fprintf(stderr, "--bucket-by specs or week buckets are wrong\n");
+        exit(1);
+    }
+    group_free();
+
+    /* Every field slot in use at once: 16 keys, --distinct, --bucket-by and
+     * 16 predicates; one more predicate is refused. */
+    int full = group_compile("k0,k1,k2,k3,k4,k5,k6,k7,k8,k9,k10,k11,k12,k13,k14,k15") && group_distinct("serial") &&
+               group_bucket("ts:1h");
+    for (int i = 0; full && i < WHERE_MAX; ++i) {
+        char pred[32];
+        snprintf(pred, sizeof(pred), "w%d=x", i);
+        full = group_where(pred);
+    }
+    if (!full || g_group_len != GROUP_FIELDS || group_where("w=x")) {
+        fprintf(stderr, "The --group-by field slots are sized wrongly\n");
+        exit(1);
+    }
+    group_free();
+
+    static const char *const json =
+        "[{\"model\":\"A\",\"ts\":\"2024-05-04T15:00:00Z\"}, {\"ts\":\"2024-05-04T15:59:59Z\",\"model\":\"A\"},\n"
+        " {\"model\":\"B\",\"ts\":1714838400}, {\"model\":\"A\",\"ts\":\"2024-05-04T16:10:00+01:00\"},\n"
+        " {\"model\":\"B\",\"ts\":\"bad\"}, {\"model\":\"C\"}, {\"ts\":\"2024-05-04T15:00:00Z\"},\n"
+        " {\"model\":\"B\",\"ts\":\"2024-05-04T17:00:00Z\",\"status\":\"retired\"}]\n";
+    FILE *fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, json);
+    const int64_t h15 = 1714834800;
+    for (int threads = 1; threads <= 3; threads += 2) {
+        if (!group_bucket("ts:1h") || !group_where("status^=ret")) {
+            fprintf(stderr, "group_bucket() refused a valid spec\n");
+            exit(1);
+        }
+        HashTable table;
+        uint64_t models_seen = 0;
+        g_chunk_size = 67;
+        counts_init(&table);
+        if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads)) {
+            fprintf(stderr, "process_file_parallel() failed with --bucket-by\n");
+            exit(1);
+        }
+        int ok = table.size == 1 && get_count(&table, "B") == 1 && bucket_count(&table, "B", h15 + 7200) == 1;
+        table_free(&table);
+        group_free();
+
+        group_bucket("ts:1h");
+        counts_init(&table);
+        models_seen = 0;
+        if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads)) {
+            exit(1);
+        }
+        ok = ok && table.size == 2 && get_count(&table, "A") == 3 && get_count(&table, "B") == 2 &&
+             table.series->len == 3 && bucket_count(&table, "A", h15) == 3 &&
+             bucket_count(&table, "B", h15 + 3600) == 1 && bucket_count(&table, "B", h15 + 7200) == 1 &&
+             bucket_count(&table, "A", h15 + 3600) == 0;
+        if (!ok) {
+            fprintf(stderr, "--bucket-by with %d threads counted wrongly\n", threads);
+            exit(1);
+        }
+        table_free(&table);
+        group_free();
+    }
+    fclose(fp);
+
+    /* Every value of a "[]" key path counts in its record's bucket. */
+    fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, "[{\"ts\":\"2024-05-04T15:10:00Z\",\"devices\":[{\"model\":\"A\"},{\"model\":\"B\"},{\"model\":\"A\"}]},\n"
+                     " {\"devices\":[{\"model\":\"A\"}],\"ts\":\"2024-05-04T16:00:00Z\"}]\n");
+    key_path_compile(&g_key_path, "devices[].model");
+    for (int threads = 1; threads <= 3; threads += 2) {
+        group_bucket("ts:1h");
+        HashTable table;
+        uint64_t models_seen = 0;
+        g_chunk_size = 41;
+        counts_init(&table);
+        if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads) ||
+            get_count(&table, "A") != 3 || get_count(&table, "B") != 1 || bucket_count(&table, "A", h15) != 2 ||
+            bucket_count(&table, "A", h15 + 3600) != 1 || bucket_count(&table, "B", h15) != 1) {
+            fprintf(stderr, "--bucket-by on a \"[]\" key path with %d threads counted wrongly\n", threads);
+            exit(1);
+        }
+        table_free(&table);
+        group_free();
+    }
+    key_path_compile(&g_key_path, KEY_MODEL);
+    fclose(fp);
+
+    /* Keys past SERIES_DENSE_KEYS are kept as sparse cells, and rows never
+     * grow beyond the dense limit. */
+    enum { MANY = 3 * SERIES_DENSE_KEYS };
+    fp = tmpfile();
+    if (!fp) exit(1);
+    write_or_die(fp, "[");
+    for (int i = 0; i < MANY; ++i) {
+        for (int j = 0; j <= i % 4; ++j) {
+            char line[96];
+            snprintf(line, sizeof(line), "{\"model\":\"M%d\",\"ts\":%lld},\n", i,
+                     (long long)(h15 + 3600 * (i % 3) + j));
+            write_or_die(fp, line);
+        }
+    }
+    write_or_die(fp, "{}]\n");
+    for (int threads = 1; threads <= 3; threads += 2) {
+        group_bucket("ts:1h");
+        HashTable table;
+        uint64_t models_seen = 0;
+        g_chunk_size = 997;
+        counts_init(&table);
+        if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, threads)) {
+            exit(1);
+        }
+        int ok = table.size == MANY && table.series->len == 3 && table.series->cells.size > 0;
+        for (size_t r = 0; r < table.series->len; ++r) {
+            ok = ok && table.series->rows[r].width <= SERIES_DENSE_KEYS;
+        }
+        for (int i = 0; ok && i < MANY; ++i) {
+            char key[16];
+            snprintf(key, sizeof(key), "M%d", i);
+            for (int b = 0; b < 3; ++b) {
+                ok = ok && bucket_count(&table, key, h15 + 3600 * b) == (uint64_t)(b == i % 3 ? i % 4 + 1 : 0);
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "--bucket-by with %d keys and %d threads counted wrongly\n", MANY, threads);
+            exit(1);
+        }
+        table_free(&table);
+        group_free();
+    }
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    fclose(fp);
+}
+
+static void collect_top_pair(const EntryView *e, void *ctx) {
+    TopHeap *all = (TopHeap *)ctx;
+    all->items[all->len].key = e->key;
+    all->items[all->len].count = e->count;
+    all->len++;
+}
+
+/* --top selection, serial or in slices, must give the head of the full sort,
+ * ties included; an N far beyond the table is fine. */
+static void expect_top_matches_sort(int engine) {
+    g_table_engine = engine;
+    HashTable table;
+    table_init(&table, 16);
+    char key[32];
+    for (unsigned i = 0; i < 150000; ++i) {
+        /* Few distinct counts, so most of the order comes from the keys. */
+        int len = snprintf(key, sizeof(key), "m%u", rng(120000));
+        table_add_one(&table, key, (size_t)len);
+    }
+    if (table.size < TOP_PARALLEL_MIN) exit(1);
+    TopHeap all = {(Pair *)xmalloc(table.size * sizeof(Pair)), 0, table.size, table.size};
+    table_foreach(&table, collect_top_pair, &all);
+    qsort(all.items, all.len, sizeof(Pair), pair_cmp);
+
+    static const size_t sizes[] = {1, 20, 1000, 200000, SIZE_MAX};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        for (int threads = 1; threads <= 4; threads += 3) {
+            size_t n;
+            Pair *top = top_select(&table, sizes[s], threads, &n);
+            int ok = n == (sizes[s] < all.len ? sizes[s] : all.len);
+            for (size_t i = 0; ok && i < n; ++i) {
+                ok = top[i].key == all.items[i].key && top[i].count == all.items[i].count;
+            }
+            if (!ok) {
+                fprintf(stderr, "Top %zu with %d threads differs from the full sort\n", sizes[s], threads);
+                exit(1);
+            }
+            free(top);
+        }
+    }
+    free(all.items);
+    table_free(&table);
+    g_table_engine = TABLE_SWISS;
+}
+
+/* Sketches fed in parts and merged must bound every tracked count, track
+ * every model above N/K and estimate the distinct count closely. */
+static void expect_approx_bounds(void) {
+    HashTable exact;
+    HashTable parts[3];
+    table_init(&exact, 16);
+    g_approx_k = 64;
+    for (int i = 0; i < 3; ++i) {
+        counts_init(&parts[i]);
+    }
+    char key[32];
+    for (unsigned i = 0; i < 60000; ++i) {
+        /* Ten heavy models among many light ones. */
+        unsigned r = rng(100);
+        int len = r < 40 ? snprintf(key, sizeof(key), "heavy%u", rng(10))
+                         : snprintf(key, sizeof(key), "light%u", rng(20000));
+        table_add_one(&exact, key, (size_t)len);
+        table_add_one(&parts[i % 3], key, (size_t)len);
+    }
+    table_merge(&parts[0], &parts[1]);
+    table_merge(&parts[0], &parts[2]);
+
+    const Approx *a = parts[0].approx;
+    uint64_t est = hll_estimate(a);
+    int ok = a->total == 60000 && a->used == a->k &&
+             (double)est > (double)exact.size * (1.0 - 5 * hll_error()) &&
+             (double)est < (double)exact.size * (1.0 + 5 * hll_error());
+    for (size_t i = 0; ok && i < a->used; ++i) {
+        const SSCounter *c = &a->counters[i];
+        uint64_t truth = get_count(&exact, c->key);
+        ok = c->count >= truth && c->count - c->error <= truth;
+    }
+    for (unsigned h = 0; ok && h < 10; ++h) {
+        int len = snprintf(key, sizeof(key), "heavy%u", h);
+        ok = a->slots[ss_slot(a, key, (size_t)len, hash_bytes(key, (size_t)len))] != 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Approximate counts broke their bounds\n");
+        exit(1);
+    }
+    for (int i = 0; i < 3; ++i) {
+        table_free(&parts[i]);
+    }
+    table_free(&exact);
+
+    /* Below K models a parallel scan is exact. */
+    FILE *fp = gen_records(3000, 0);
+    HashTable ref;
+    g_approx_k = 0;
+    scan_generated(fp, 1, &ref);
+    g_approx_k = 64;
+    g_chunk_size = 4096;
+    HashTable table;
+    uint64_t models_seen = 0;
+    counts_init(&table);
+    if (fseek(fp, 0, SEEK_SET) != 0 || !process_file_parallel(fp, &table, &models_seen, NULL, 3) ||
+        table.approx->used != ref.size || table.approx->total != models_seen) {
+        fprintf(stderr, "Approximate parallel scan went wrong\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < table.approx->used; ++i) {
+        const SSCounter *c = &table.approx->counters[i];
+        if (c->error || c->count != get_count(&ref, c->key)) {
+            fprintf(stderr, "Approximate count of '%s' is not exact\n", c->key);
+            exit(1);
+        }
+    }
+    g_approx_k = 0;
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    table_free(&table);
+    table_free(&ref);
+    fclose(fp);
+}
+
+/* The reporter is woken for every due checkpoint, counted from the start of
+ * the scan, whatever the progress interval. */
+static void expect_checkpoint_schedule(void) {
+    Checkpoint ck;
+    memset(&ck, 0, sizeof(ck));
+    atomic_init(&ck.epoch, 0);
+    ck.interval = 1.0;
+    checkpoint_arm(&ck, 100.0);
+    int ok = checkpoint_next(&ck, 100.0) == 101.0;
+    checkpoint_tick(&ck, 100.5, 0);
+    ok = ok && atomic_load(&ck.epoch) == 0;
+    checkpoint_tick(&ck, 101.0, 0);
+    ok = ok && atomic_load(&ck.epoch) == 1 && checkpoint_next(&ck, 101.0) == 102.0;
+
+    ck.interval = 0.0;
+    ck.every_bytes = 1000;
+    ok = ok && checkpoint_next(&ck, 101.0) <= 101.0 + CKPT_BYTES_POLL_SEC;
+    checkpoint_tick(&ck, 101.1, 999);
+    ok = ok && atomic_load(&ck.epoch) == 1;
+    checkpoint_tick(&ck, 101.2, 1000);
+    ok = ok && atomic_load(&ck.epoch) == 2;
+    if (!ok) {
+        fprintf(stderr, "Checkpoints are scheduled wrongly\n");
+        exit(1);
+    }
+}
+
+/* A scan resumed from a checkpoint must end with the uninterrupted counts,
+ * serially and in parallel, and refuse a checkpoint of the other kind. */
+static void expect_checkpoint_resume(int threads) {
+    char input[] = "/tmp/model_count_inputXXXXXX";
+    int fd = mkstemp(input);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp() failed\n");
+        exit(1);
+    }
+    close(fd);
+    char ckpt_path[64];
+    snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", input);
+
+    FILE *gen = gen_records(30000, 0);
+    HashTable ref;
+    scan_generated(gen, 1, &ref);
+    write_file(input, gen);
+    fclose(gen);
+
+    /* A checkpoint is due from the start, so one is written early on. */
+    g_chunk_size = 4096;
+    Checkpoint ck;
+    HashTable table;
+    uint64_t models_seen = 0;
+    if (!checkpoint_init(&ck, ckpt_path, input)) exit(1);
+    atomic_store(&ck.epoch, 1);
+    g_checkpoint = &ck;
+    FILE *fp = fopen(input, "rb");
+    table_init(&table, 16);
+    if (!fp || !process_file_parallel(fp, &table, &models_seen, NULL, threads)) {
+        fprintf(stderr, "Checkpointed scan failed\n");
+        exit(1);
+    }
+    fclose(fp);
+    table_free(&table);
+    checkpoint_free(&ck);
+
+    for (int round = 0; round < 2; ++round) {
+        /* The second round resumes with the other kind of scan. */
+        int t = round ? (threads > 1 ? 1 : 3) : threads;
+        if (!checkpoint_init(&ck, ckpt_path, input) || checkpoint_load(&ck) != 1 ||
+            (threads == 1 && (ck.kind != CKPT_SERIAL || ck.offset == 0)) ||
+            (threads > 1 && ck.kind != CKPT_CHUNKS)) {
+            fprintf(stderr, "Checkpoint was not written as expected\n");
+            exit(1);
+        }
+        g_checkpoint = &ck;
+        fp = fopen(input, "rb");
+        models_seen = 0;
+        table_init(&table, 16);
+        int ok = fp && process_file_parallel(fp, &table, &models_seen, NULL, t);
+        if (ok != !round || (ok && (!tables_equal(&ref, &table) || !tables_equal(&table, &ref)))) {
+            fprintf(stderr, "Resume with %d threads from a %d-thread checkpoint went wrong\n", t, threads);
+            exit(1);
+        }
+        fclose(fp);
+        table_free(&table);
+        checkpoint_free(&ck);
+    }
+
+    g_checkpoint = NULL;
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    remove(ckpt_path);
+    remove(input);
+    table_free(&ref);
+}
+
+/* The i-th record's model as recorded in l. */
+static const char *seq_key(const SeqLog *l, const char **keys, size_t i) {
+    return keys[l->seq[i]];
+}
+
+static const char **seq_keys(const SeqLog *l) {
+    DictCtx dict = {(const char **)xmalloc((l->ids.size + 1) * sizeof(char *)),
+                    (size_t *)xmalloc((l->ids.size + 1) * sizeof(size_t))};
+    table_foreach(&l->ids, dict_entry, &dict);
+    free(dict.lens);
+    return dict.keys;
+}
+
+/* A sidecar built serially or in parallel lists the records in file order,
+ * and loading it gives the counts of a full scan. */
+static void expect_sidecar_roundtrip(void) {
+    char input[] = "/tmp/model_count_sideXXXXXX";
+    int fd = mkstemp(input);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp() failed\n");
+        exit(1);
+    }
+    close(fd);
+    FILE *gen = gen_records(5000, 0);
+    HashTable ref;
+    scan_generated(gen, 1, &ref);
+    write_file(input, gen);
+    fclose(gen);
+
+    Sidecar serial;
+    g_chunk_size = 4096;
+    for (int threads = 1; threads <= 3; threads += 2) {
+        Sidecar sc;
+        HashTable table;
+        uint64_t models_seen = 0;
+        if (!sidecar_init(&sc, NULL, input)) exit(1);
+        g_sidecar = &sc;
+        FILE *fp = fopen(input, "rb");
+        table_init(&table, 16);
+        if (!fp || !process_file_parallel(fp, &table, &models_seen, NULL, threads) || sc.log.len != models_seen) {
+            fprintf(stderr, "Sidecar scan with %d threads failed\n", threads);
+            exit(1);
+        }
+        fclose(fp);
+        g_sidecar = NULL;
+        table_free(&table);
+
+        if (threads == 1) {
+            serial = sc;
+            continue;
+        }
+        const char **a = seq_keys(&serial.log);
+        const char **b = seq_keys(&sc.log);
+        for (size_t i = 0; i < sc.log.len; ++i) {
+            if (strcmp(seq_key(&serial.log, a, i), seq_key(&sc.log, b, i)) != 0) {
+                fprintf(stderr, "Parallel sidecar differs at record %zu\n", i);
+                exit(1);
+            }
+        }
+        free(a);
+        free(b);
+
+        sidecar_write(&sc);
+        models_seen = 0;
+        table_init(&table, 16);
+        if (!sidecar_load(&serial, &table, &models_seen) || models_seen != sc.log.len ||
+            !tables_equal(&ref, &table) || !tables_equal(&table, &ref)) {
+            fprintf(stderr, "Sidecar did not load back the scanned counts\n");
+            exit(1);
+        }
+        table_free(&table);
+
+        /* A changed input invalidates it. */
+        serial.input_mtime++;
+        table_init(&table, 16);
+        if (sidecar_load(&serial, &table, &models_seen) || table.size != 0) {
+            fprintf(stderr, "Stale sidecar was accepted\n");
+            exit(1);
+        }
+        remove(sc.path);
+        table_free(&table);
+        sidecar_free(&sc);
+    }
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    sidecar_free(&serial);
+    remove(input);
+    table_free(&ref);
+}
+
+/* A parallel scan builds the same index as a serial walk of the boundaries,
+ * and scans cut by the loaded index match the plain scan.  With strides
+ * shorter than a record, strides without a boundary of their own must still
+ * name the next one. */
+static void expect_index_matches_boundaries(uint64_t stride) {
+    char input[] = "/tmp/model_count_indexXXXXXX";
+    int fd = mkstemp(input);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp() failed\n");
+        exit(1);
+    }
+    close(fd);
+    FILE *gen = gen_records(4000, 0);
+    size_t len;
+    unsigned char *data = read_all(gen, &len);
+    HashTable ref;
+    scan_generated(gen, 1, &ref);
+    write_file(input, gen);
+    fclose(gen);
+
+    OffsetIndex ix;
+    if (!index_init(&ix, NULL, input, stride)) exit(1);
+    g_index = &ix;
+    g_chunk_size = 3 * stride + 100;
+    for (int round = 0; round < 2; ++round) {
+        HashTable table;
+        uint64_t models_seen = 0;
+        FILE *fp = fopen(input, "rb");
+        table_init(&table, 16);
+        if (!fp || !process_file_parallel(fp, &table, &models_seen, NULL, 3) || !tables_equal(&ref, &table) ||
+            !tables_equal(&table, &ref) || ix.built == round) {
+            fprintf(stderr, "Scan %s the index went wrong\n", round ? "using" : "building");
+            exit(1);
+        }
+        fclose(fp);
+        table_free(&table);
+        if (round) break;
+
+        ScanState st = {0, 0, 0};
+        for (size_t i = 0; i < ix.count; ++i) {
+            const unsigned char *q = data + i * ix.stride;
+            const unsigned char *b = i == 0 ? q : find_record_boundary(q, data + len, st);
+            if (ix.offsets[i] != (b ? (uint64_t)(b - data) : len)) {
+                fprintf(stderr, "Index entry %zu is wrong\n", i);
+                exit(1);
+            }
+            ChunkSummary sum;
+            const unsigned char *end = i + 1 < ix.count ? q + ix.stride : data + len;
+            summarize_chunk(q, end, &sum);
+            st = chunk_exit_state(st, q, end, &sum);
+        }
+        index_write(&ix);
+        index_free(&ix);
+        if (!index_init(&ix, NULL, input, 1 << 20) || !index_load(&ix) || ix.stride != stride) {
+            fprintf(stderr, "Index did not load back\n");
+            exit(1);
+        }
+    }
+
+    g_index = NULL;
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    remove(ix.path);
+    index_free(&ix);
+    remove(input);
+    table_free(&ref);
+    free(data);
+}
+
+static void append_bytes(const char *path, const char *mode, const unsigned char *data, size_t len) {
+    FILE *fp = fopen(path, mode);
+    if (!fp || fwrite(data, 1, len, fp) != len || fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write '%s'\n", path);
+        exit(1);
+    }
+}
+
+/* Following a log that grows in pieces cut mid-line must count every line
+ * once, and a rotated file must be read again from its start. */
+static void expect_follow_appends(int threads) {
+    char path[] = "/tmp/model_count_followXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "mkstemp() failed\n");
+        exit(1);
+    }
+    close(fd);
+
+    FILE *gen = gen_records(3000, 1);
+    size_t len;
+    unsigned char *data = read_all(gen, &len);
+    HashTable ref;
+    scan_generated(gen, 1, &ref);
+    fclose(gen);
+
+    g_ndjson = 1;
+    g_chunk_size = 4096;
+    Follow f;
+    HashTable table;
+    uint64_t models_seen = 0;
+    table_init(&table, 16);
+    if (!follow_open(&f, path)) exit(1);
+    size_t cuts[] = {0, len / 3, len / 3 + 1, len * 2 / 3, len};
+    for (size_t i = 1; i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+        append_bytes(path, "ab", data + cuts[i - 1], cuts[i] - cuts[i - 1]);
+        const unsigned char *nl = memrchr(data, '\n', cuts[i]);
+        if (!follow_update(&f, threads, &table, &models_seen, NULL) ||
+            f.done != (nl ? (uint64_t)(nl + 1 - data) : 0)) {
+            fprintf(stderr, "Follow update %zu stopped at the wrong offset\n", i);
+            exit(1);
+        }
+    }
+    int same = tables_equal(&ref, &table) && tables_equal(&table, &ref);
+
+    char moved[64];
+    snprintf(moved, sizeof(moved), "%s.1", path);
+    if (rename(path, moved) != 0) exit(1);
+    append_bytes(path, "wb", data, len);
+    HashTable twice;
+    table_init(&twice, 16);
+    table_merge(&twice, &ref);
+    table_merge(&twice, &ref);
+    if (!same || !follow_reopen(&f) || !follow_update(&f, threads, &table, &models_seen, NULL) ||
+        !tables_equal(&twice, &table)) {
+        fprintf(stderr, "Follow with %d threads missed appended or rotated lines\n", threads);
+        exit(1);
+    }
+
+    follow_close(&f);
+    g_ndjson = 0;
+    g_chunk_size = CHUNK_SIZE_DEFAULT;
+    remove(moved);
+    remove(path);
+    table_free(&twice);
+    table_free(&table);
+    table_free(&ref);
+    free(data);
+}
+
+/* NDJSON splitting at newlines must build the serial table for any chunk
+ * size, including chunks that end exactly on a newline. */
+static void expect_ndjson_split_matches_serial(void) {
+    for (int round = 0; round < 10; ++round) {
+        FILE *fp = gen_records(50 + rng(400), 1);
+
+        HashTable ref;
+        scan_generated(fp, 1, &ref);
+
+        g_ndjson = 1;
+        for (size_t chunk = 1; chunk <= 257; chunk += 16) {
+            HashTable table;
+            g_chunk_size = chunk;
+            scan_generated(fp, 3, &table);
+            if (!tables_equal(&ref, &table) || !tables_equal(&table, &ref)) {
+                fprintf(stderr, "NDJSON split with %zu-byte chunks disagrees with the serial scan\n", chunk);
+                exit(1);
+            }
+            table_free(&table);
+        }
+        g_ndjson = 0;
+        g_chunk_size = CHUNK_SIZE_DEFAULT;
+
+        table_free(&ref);
+        fclose(fp);
+    }
+}
+
+/* Both table engines must agree on a high-cardinality input that forces
+ * many resizes, including after merging. */
+static void expect_engines_agree(void) {
+    HashTable chained;
+    HashTable swiss;
+    g_table_engine = TABLE_CHAINED;
+    table_init(&chained, 16);
+    g_table_engine = TABLE_SWISS;
+    table_init(&swiss, 16);
+
+    /* Every seventh key is too long to be stored inline. */
+    char key[64];
+    for (unsigned i = 0; i < 200000; ++i) {
+        unsigned sn = rng(150000);
+        snprintf(key, sizeof(key), "%sSN%u", sn % 7 ? "" : "A-SERIAL-TOO-LONG-TO-INLINE-", sn);
+        inc(&chained, key);
+        inc(&swiss, key);
+    }
+    if (!tables_equal(&chained, &swiss) || !tables_equal(&swiss, &chained)) {
+        fprintf(stderr, "Chained and Swiss tables disagree\n");
+        exit(1);
+    }
+
+    HashTable merged;
+    table_init(&merged, 16);
+    table_merge(&merged, &chained);
+    table_merge(&merged, &swiss);
+    if (merged.size != swiss.size || get_count(&merged, key) != 2 * get_count(&swiss, key)) {
+        fprintf(stderr, "Merged table has wrong counts\n");
+        exit(1);
+    }
+
+    table_free(&merged);
+    table_free(&swiss);
+    table_free(&chained);
+}
+
+/* Counting through the front cache must match counting without it, across
+ * table growth (which moves Swiss slots) and prefix-sharing long keys. */
+static void expect_front_cache_agrees(int engine) {
+    static const char *const hot[] = {"", "A", "ST4000DM000", "ST4000DM000X", "ST4000DM001",
+                                      "HGST HMS5C4040BLE640", "HGST HMS5C4040BLE641"};
+    HashTable cached;
+    HashTable plain;
+    g_table_engine = engine;
+    table_init(&cached, 16);
+    table_init(&plain, 16);
+
+    char key[64];
+    for (unsigned i = 0; i < 100000; ++i) {
+        const char *k = hot[rng(sizeof(hot) / sizeof(hot[0]))];
+        if (i % 10 == 0) {
+            snprintf(key, sizeof(key), "SN%u", i);
+            k = key;
+        }
+        table_add_one(&cached, k, strlen(k));
+        inc(&plain, k);
+    }
+    if (!tables_equal(&cached, &plain) || !tables_equal(&plain, &cached) || cached.front.bypass) {
+        fprintf(stderr, "Front cache disagrees with the table (engine %d)\n", engine);
+        exit(1);
+    }
+
+    /* All-unique keys switch the cache off. */
+    for (unsigned i = 0; i < 2 * FRONT_WINDOW; ++i) {
+        snprintf(key, sizeof(key), "U%u", i);
+        table_add_one(&cached, key, strlen(key));
+    }
+    if (!cached.front.bypass) {
+        fprintf(stderr, "Front cache stayed on for unique keys (engine %d)\n", engine);
+        exit(1);
+    }
+
+    table_free(&plain);
+    table_free(&cached);
+    g_table_engine = TABLE_SWISS;
+}
+
+int main(void) {
+    expect_engines_agree();
+    expect_front_cache_agrees(TABLE_SWISS);
+    expect_front_cache_agrees(TABLE_CHAINED);
+    expect_files_merge();
+    expect_key_paths();
+    expect_group_by();
+    expect_distinct_counts();
+    expect_distinct_keeps_key_counts();
+    expect_where_filters();
+    expect_bucket_by();
+    expect_approx_bounds();
+    expect_top_matches_sort(TABLE_SWISS);
+    expect_top_matches_sort(TABLE_CHAINED);
+    expect_checkpoint_schedule();
+    expect_checkpoint_resume(1);
+    expect_checkpoint_resume(3);
+    expect_follow_appends(1);
+    expect_follow_appends(3);
+    expect_sidecar_roundtrip();
+    expect_index_matches_boundaries(4096);
+    expect_index_matches_boundaries(16);
+#ifdef HAVE_ZLIB
+    expect_compressed_matches_plain(DEC_GZIP, 30000, 2);
+#endif
+#ifdef HAVE_ZSTD
+    expect_compressed_matches_plain(DEC_ZSTD, 30000, 2);
+    /* Frames far shorter than records, so records span several frames. */
+    expect_compressed_matches_plain(DEC_ZSTD, 300, 2000);
+#endif
+
+    /* Tiny arena chunks, so most keys and entries start a new chunk. */
+    g_arena_chunk_size = 64;
+    expect_engines_agree();
+    g_arena_chunk_size = ARENA_CHUNK_DEFAULT;
+
+    g_arena_huge_pages = 1;
+    expect_engines_agree();
+    g_arena_huge_pages = 0;
+
+    g_table_engine = TABLE_CHAINED;
+    run_cases();
+    g_table_engine = TABLE_SWISS;
+
+    for (int level = SIMD_OFF; level <= SIMD_AVX512; ++level) {
+        if (simd_select(level) != level) continue;
+
+        run_cases();
+
+        /* Same inputs through the buffered stream path instead of mmap. */
+        g_use_mmap = 0;
+        run_cases();
+        g_use_mmap = 1;
+
+        expect_ndjson_split_matches_serial();
+
+        /* Parallel scans with chunks small enough to cut through strings,
+         * escapes and nested values. */
+        test_threads = 3;
+        for (size_t chunk = 1; chunk <= 17; ++chunk) {
+            g_chunk_size = chunk;
+            run_cases();
+        }
+        g_chunk_size = CHUNK_SIZE_DEFAULT;
+        test_threads = 1;
+    }
+
+    expect_simd_matches_scalar();
+
     printf("All unit tests passed.\n");
     return 0;
 }